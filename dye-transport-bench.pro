@@ -0,0 +1,43 @@
+TEMPLATE = app
+TARGET = dye-transport-bench
+CONFIG += console c++11
+CONFIG -= app_bundle
+CONFIG -= qt
+
+QMAKE_CXXFLAGS += -fopenmp
+QMAKE_CXXFLAGS_RELEASE -= -O2
+QMAKE_CXXFLAGS_RELEASE += -O3
+
+SOURCES += \
+    src/benchmark.cpp \
+    src/fluid-sim/math.cpp \
+    src/fluid-sim/allocation.cpp \
+    src/fluid-sim/taskgraph.cpp \
+    src/fluid-sim/fluidsystem.cpp \
+    src/fluid-sim/fluidensemble.cpp \
+    src/fluid-sim/timestepcontroller.cpp \
+    src/fluid-sim/slab.cpp \
+    src/fluid-sim/partitionedfluidsystem.cpp \
+    src/fluid-sim/adaptivefluidsystem.cpp \
+    src/graphics/fluidmanipulator.cpp
+
+HEADERS += \
+    src/fluid-sim/math.h \
+    src/fluid-sim/sweeps.tpp \
+    src/fluid-sim/allocation.h \
+    src/fluid-sim/taskgraph.h \
+    src/fluid-sim/vectorfield.h \
+    src/fluid-sim/vectorfieldexpression.h \
+    src/fluid-sim/vectorfield.tpp \
+    src/fluid-sim/fluidsystem.h \
+    src/fluid-sim/fluidsystem.tpp \
+    src/fluid-sim/fluidensemble.h \
+    src/fluid-sim/timestepcontroller.h \
+    src/fluid-sim/slab.h \
+    src/fluid-sim/partitionedfluidsystem.h \
+    src/fluid-sim/adaptivefluidsystem.h \
+    src/graphics/fluidmanipulator.h
+
+INCLUDEPATH += ext/eigen3.3b2
+
+LIBS += -fopenmp -lpthread
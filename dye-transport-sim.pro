@@ -10,25 +10,46 @@ QMAKE_CXXFLAGS_RELEASE += -O3
 SOURCES += \
     src/main.cpp \
     src/fluid-sim/math.cpp \
+    src/fluid-sim/allocation.cpp \
+    src/fluid-sim/taskgraph.cpp \
     src/fluid-sim/fluidsystem.cpp \
+    src/fluid-sim/fluidensemble.cpp \
+    src/fluid-sim/timestepcontroller.cpp \
+    src/fluid-sim/qualitycontroller.cpp \
+    src/fluid-sim/adaptivefluidsystem.cpp \
+    src/fluid-sim/slab.cpp \
+    src/fluid-sim/partitionedfluidsystem.cpp \
     src/graphics/shader.cpp \
     src/graphics/fluidtexture.cpp \
     src/graphics/resourcemanager.cpp \
     src/graphics/canvas.cpp \
     src/graphics/interface.cpp \
+    src/graphics/simulationworker.cpp \
     src/graphics/fluidmanipulator.cpp
 
 HEADERS += \
     src/fluid-sim/math.h \
+    src/fluid-sim/sweeps.tpp \
+    src/fluid-sim/allocation.h \
+    src/fluid-sim/taskgraph.h \
     src/fluid-sim/vectorfield.h \
+    src/fluid-sim/vectorfieldexpression.h \
     src/fluid-sim/vectorfield.tpp \
     src/fluid-sim/fluidsystem.h \
     src/fluid-sim/fluidsystem.tpp \
+    src/fluid-sim/fluidensemble.h \
+    src/fluid-sim/timestepcontroller.h \
+    src/fluid-sim/qualitycontroller.h \
+    src/fluid-sim/adaptivefluidsystem.h \
+    src/fluid-sim/slab.h \
+    src/fluid-sim/partitionedfluidsystem.h \
     src/graphics/shader.h \
     src/graphics/fluidtexture.h \
     src/graphics/canvas.h \
     src/graphics/resourcemanager.h \
     src/graphics/interface.h \
+    src/graphics/simulationworker.h \
+    src/graphics/triplebuffer.h \
     src/graphics/fluidmanipulator.h
 
 DISTFILES += \
@@ -43,4 +64,4 @@ INSTALLS += shaders
 
 INCLUDEPATH += ext/eigen3.3b2 ext/glm-0.9.7.6
 
-LIBS += -fopenmp -lGL -lGLEW -lglfw
+LIBS += -fopenmp -lpthread -lGL -lGLEW -lglfw
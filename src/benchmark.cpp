@@ -0,0 +1,436 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <omp.h>
+
+#include "src/fluid-sim/adaptivefluidsystem.h"
+#include "src/fluid-sim/allocation.h"
+#include "src/fluid-sim/fluidensemble.h"
+#include "src/fluid-sim/fluidsystem.h"
+#include "src/fluid-sim/partitionedfluidsystem.h"
+#include "src/graphics/fluidmanipulator.h"
+
+// Headless benchmark of the simulation kernels, without any OpenGL dependencies.
+// With --verify, it runs checks of the simulation instead of timing anything, and exits
+// with a nonzero status if any of them fails.
+// Usage: dye-transport-bench [width height depth [repetitions]] [--verify]
+
+struct Kernel {
+    std::string name;
+    std::function<void()> run;
+};
+
+// Returns the mean wall time of a kernel in ms
+double time(const Kernel &kernel, int repetitions) {
+    kernel.run(); // warm up caches and the OpenMP thread pool
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repetitions; ++i) {
+        kernel.run();
+    }
+    auto stop = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(stop - start).count() / repetitions;
+}
+
+// Prints per-kernel times and speedups over one thread for increasing thread counts
+void printSpeedupTable(const std::vector<Kernel> &kernels, int repetitions) {
+    std::vector<int> threadCounts;
+    for (int threads = 1; threads < omp_get_max_threads(); threads *= 2) {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(omp_get_max_threads());
+
+    std::cout << std::left << std::setw(20) << "kernel";
+    for (int threads : threadCounts) {
+        std::cout << std::right << std::setw(10) << (std::to_string(threads) + "T ms")
+                  << std::setw(9) << "speedup";
+    }
+    std::cout << std::endl;
+    for (const Kernel &kernel : kernels) {
+        std::cout << std::left << std::setw(20) << kernel.name << std::fixed;
+        double serialTime = 0;
+        for (int threads : threadCounts) {
+            omp_set_num_threads(threads);
+            double t = time(kernel, repetitions);
+            if (threads == 1) serialTime = t;
+            std::cout << std::right << std::setw(10) << std::setprecision(3) << t
+                      << std::setw(8) << std::setprecision(2) << (serialTime / t) << "x";
+        }
+        std::cout << std::endl;
+    }
+    omp_set_num_threads(threadCounts.back());
+}
+
+// An analytic estimate, not a measurement, of the bytes a step of a system moves to and
+// from memory, as of its last step, with or without fused stages and sparse sources. Every
+// pass over a grid counts all of its cells once, ghost cells included, and each velocity
+// component read by a backtrace counts once; passes over the faces alone, or over sparse
+// sources, are left out, and so are cache hits and misses.
+double estimatedStepBytes(const FluidSystem &system, bool fused, bool sparseSources) {
+    auto bytes = [](const TensorIndices &dim) {
+        return static_cast<double>(dim[0] * dim[1] * dim[2] * sizeof(Scalar));
+    };
+    const double dye = bytes(system.fullDim), velocity = bytes(system.fullStaggeredDim);
+    const double pressure = bytes(system.fullVelocityDim);
+    // Adding dense sources reads the field and the source and writes the field, and then
+    // diffusion copies the field (read, write) into the grids it starts from: two for an odd
+    // number of Jacobi iterations, whose result is copied back. Fused, the copies only take
+    // a write each.
+    auto diffusion = [&](const FluidSystem::Diffusion &diffusion, double grid) {
+        const double sources = sparseSources ? 0 : 3 * grid;
+        if (diffusion.scheme == FluidSystem::kDiffusionNone) return sources;
+        const bool implicit = diffusion.scheme == FluidSystem::kDiffusionImplicit;
+        const int starts = implicit && diffusion.sweeps % 2 ? 2 : 1;
+        const double start = fused && !sparseSources ? (3 + starts) * grid
+                                                     : sources + 2 * starts * grid;
+        // Explicit sweeps read and write the field, and Jacobi iterations read the initial
+        // grid too
+        if (!implicit) return start + diffusion.sweeps * 2 * grid;
+        return start + diffusion.sweeps * 3 * grid + (starts - 1) * 2 * grid;
+    };
+    // Each backtrace reads the field and the velocity and writes the result
+    auto advection = [&](double grid) {
+        const double backtrace = 2 * grid + 3 * velocity;
+        const double peak = 3 * velocity;
+        if (system.advection == FluidSystem::kAdvectionSemiLagrangian) return peak + backtrace;
+        // The copy before the backward trace, and the correction (read, read, write)
+        return peak + 3 * backtrace + 5 * grid;
+    };
+    const unsigned int iterations = system.solverIterations;
+    const double solve = (2 + (iterations % 2 ? 4 : 0) + 3 * iterations) * pressure;
+    // Divergence (and its negation), solve, gradient and subtraction
+    const double projection =
+        fused ? 3 * velocity + pressure + solve + 3 * (pressure + 2 * velocity)
+              : 3 * velocity + 3 * pressure + solve + pressure + 12 * velocity;
+    return DyeField::coords * (diffusion(system.densityDiffusion, dye) + advection(dye)) +
+           VelocityField::coords * (diffusion(system.velocityDiffusion, velocity) +
+                                    advection(velocity)) +
+           2 * projection;
+}
+
+// Whether soap circles of every radius down to one cell, as half detail or a coarser
+// velocity grid make the default ones, stamp finite sources
+bool smallSoapCirclesFinite() {
+    for (Grid::Index velocityScale = 1; velocityScale <= 2; ++velocityScale) {
+        for (int radius = 1; radius <= 12; ++radius) {
+            auto system = std::make_shared<FluidSystem>(40, 36, 6, 0, 0, velocityScale);
+            FluidManipulator manipulator(system);
+            manipulator.addSoapCircle(20, 18, radius, 40, 10, kAdditionConstantAdditive);
+            for (std::size_t d = 0; d < VelocityField::coords; ++d) {
+                const Eigen::Tensor<bool, 0> finite =
+                        manipulator.flowSource()[d].isfinite().all();
+                if (!finite()) {
+                    std::cout << "Soap circle of radius " << radius << " at velocity scale "
+                              << velocityScale << " stamps non-finite sources" << std::endl;
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Sources which are the same smooth functions of position at any resolution, on cells
+// 1 / ratio as wide as those of a 32x32 grid: dye in a blob, and a swirl beside it which
+// winds the dye into fronts. Velocity components are sampled on their faces.
+void stampSources(DyeField &dye, VelocityField &flow, Grid::Index ratio) {
+    const Scalar r = ratio;
+    const Scalar dyeX = 12, dyeY = 16, dyeRadius = 3;
+    const Scalar swirlX = 17, swirlY = 16, swirlRadius = 6, swirlSpeed = 20;
+    auto swirl = [&](Scalar x, Scalar y) {
+        const Scalar dx = x - swirlX, dy = y - swirlY;
+        return swirlSpeed / swirlRadius *
+               std::exp(-(dx * dx + dy * dy) / (swirlRadius * swirlRadius));
+    };
+    for (Grid::Index k = 1; k < dye[0].dimension(2) - 1; ++k) {
+        for (Grid::Index j = 1; j < dye[0].dimension(1) - 1; ++j) {
+            for (Grid::Index i = 1; i < dye[0].dimension(0) - 1; ++i) {
+                const Scalar dx = (i - 0.5f) / r - dyeX, dy = (j - 0.5f) / r - dyeY;
+                dye[0](i, j, k) = std::exp(-(dx * dx + dy * dy) / (dyeRadius * dyeRadius));
+            }
+        }
+    }
+    for (Grid::Index k = 1; k < flow[0].dimension(2) - 2; ++k) {
+        for (Grid::Index j = 1; j < flow[0].dimension(1) - 2; ++j) {
+            for (Grid::Index i = 1; i < flow[0].dimension(0) - 2; ++i) {
+                const Scalar faceX = (i - 1) / r, centreX = (i - 0.5f) / r;
+                const Scalar faceY = (j - 1) / r, centreY = (j - 0.5f) / r;
+                flow[0](i, j, k) = -(centreY - swirlY) * swirl(faceX, centreY);
+                flow[1](i, j, k) = (centreX - swirlX) * swirl(centreX, faceY);
+            }
+        }
+    }
+}
+
+// Peak divergence of the base of an adaptive system over the cells outside of the patch cores
+// within two cells of them, whose differences reach the faces averaged down, and elsewhere
+void peakBaseDivergence(const AdaptiveFluidSystem &adaptive, Scalar &nearCores,
+                        Scalar &elsewhere) {
+    const FluidSystem &base = *adaptive.base;
+    const VelocityField &u = base.velocity;
+    const Location w = 0.5 / base.velocitySpacing();
+    auto core = [&](Grid::Index i, Grid::Index j) {
+        for (const AdaptiveFluidSystem::Patch &patch : adaptive.patches) {
+            if (i >= patch.coreBegin(0) && i <= patch.coreEnd(0) &&
+                j >= patch.coreBegin(1) && j <= patch.coreEnd(1)) return true;
+        }
+        return false;
+    };
+    nearCores = elsewhere = 0;
+    for (Grid::Index k = 1; k <= base.velocityDim(2); ++k) {
+        for (Grid::Index j = 1; j <= base.velocityDim(1); ++j) {
+            for (Grid::Index i = 1; i <= base.velocityDim(0); ++i) {
+                if (core(i, j)) continue;
+                const Scalar divergence =
+                        std::abs(w(0) * (u[0](i + 1, j, k) - u[0](i - 1, j, k)) +
+                                 w(1) * (u[1](i, j + 1, k) - u[1](i, j - 1, k)) +
+                                 w(2) * (u[2](i, j, k + 1) - u[2](i, j, k - 1)));
+                bool next = false;
+                for (Grid::Index dj = -2; dj <= 2; ++dj) {
+                    for (Grid::Index di = -2; di <= 2; ++di) next |= core(i + di, j + dj);
+                }
+                Scalar &peak = next ? nearCores : elsewhere;
+                peak = std::max(peak, divergence);
+            }
+        }
+    }
+}
+
+// Relative L1 differences from a uniformly fine run of the dye of an adaptive run, and of
+// the same run without patches, whose composite is the base interpolated; also the peak
+// divergences of the adaptive run's base as in peakBaseDivergence()
+void compareAdaptive(Scalar &adaptiveDifference, Scalar &coarseDifference,
+                     std::size_t &numPatches, Scalar &nearCores, Scalar &elsewhere) {
+    const Grid::Index width = 32, height = 32, depth = 4, ratio = 2;
+    const Scalar dt = 0.05;
+    const int steps = 20;
+    FluidSystem fine(width * ratio, height * ratio, depth, 0.0001, 0.0001);
+    fine.spacing = fine.spacing / Location(ratio, ratio, 1);
+    DyeField fineDye(fine.fullDim);
+    VelocityField fineFlow(fine.fullStaggeredDim);
+    stampSources(fineDye, fineFlow, ratio);
+    for (int i = 0; i < steps; ++i) fine.step(fineDye, fineFlow, dt);
+
+    auto difference = [&](bool refine) {
+        AdaptiveFluidSystem adaptive(width, height, depth, 0.0001, 0.0001, ratio, 8);
+        if (!refine) {
+            adaptive.gradientThreshold = std::numeric_limits<Scalar>::infinity();
+            adaptive.vorticityThreshold = std::numeric_limits<Scalar>::infinity();
+        }
+        DyeField dye(adaptive.base->fullDim);
+        VelocityField flow(adaptive.base->fullStaggeredDim);
+        stampSources(dye, flow, 1);
+        for (int i = 0; i < steps; ++i) adaptive.step(dye, flow, dt);
+        if (refine) {
+            numPatches = adaptive.patches.size();
+            peakBaseDivergence(adaptive, nearCores, elsewhere);
+        }
+        DyeField composite(adaptive.fineFullDim);
+        adaptive.compositeDensity(composite);
+        const Eigen::Tensor<Scalar, 0> error = (composite[0] - fine.density[0]).abs().sum();
+        const Eigen::Tensor<Scalar, 0> total = fine.density[0].abs().sum();
+        return error() / total();
+    };
+    adaptiveDifference = difference(true);
+    coarseDifference = difference(false);
+}
+
+// Runs the checks of --verify, reporting each
+bool verify() {
+    bool passed = true;
+    const bool finite = smallSoapCirclesFinite();
+    std::cout << "Small soap circles stamp finite sources: " << (finite ? "ok" : "FAILED")
+              << std::endl;
+    passed &= finite;
+
+    Scalar adaptiveDifference, coarseDifference, nearCores, elsewhere;
+    std::size_t numPatches = 0;
+    compareAdaptive(adaptiveDifference, coarseDifference, numPatches, nearCores, elsewhere);
+    const bool closer = numPatches > 0 && adaptiveDifference < coarseDifference;
+    std::cout << "Adaptive dye differs from a uniformly fine run by " << adaptiveDifference
+              << " (relative L1) with " << numPatches << " patches, against "
+              << coarseDifference << " unrefined: " << (closer ? "ok" : "FAILED") << std::endl;
+    passed &= closer;
+    // The composite projection should leave no more divergence at the patch edges than the
+    // Jacobi iterations leave elsewhere
+    const bool matched = nearCores <= 1.25f * elsewhere;
+    std::cout << "Adaptive base divergence near the patch cores peaks at " << nearCores
+              << ", against " << elsewhere << " elsewhere: " << (matched ? "ok" : "FAILED")
+              << std::endl;
+    passed &= matched;
+    return passed;
+}
+
+int main(int argc, char *argv[]) {
+    bool verifyOnly = false;
+    std::vector<char *> args;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--verify") == 0) verifyOnly = true;
+        else args.push_back(argv[i]);
+    }
+    if (verifyOnly) return verify() ? 0 : 1;
+
+    Grid::Index width = 80, height = 80, depth = 6;
+    int repetitions = 20;
+    if (args.size() >= 3) {
+        width = std::atol(args[0]);
+        height = std::atol(args[1]);
+        depth = std::atol(args[2]);
+    }
+    if (args.size() >= 4) repetitions = std::atoi(args[3]);
+
+    // Solver kernels for the default grid and its staggered velocity grids; other grids
+    // only have kernels specialized for their depth
+    specializeKernels<80, 80, 6>();
+    specializeKernels<81, 81, 7>();
+
+    reportThreadBinding(std::cout);
+    std::cout << "Grid " << width << "x" << height << "x" << depth << ", "
+              << repetitions << " repetitions" << std::endl << std::endl;
+
+    auto fluidSystem = std::make_shared<FluidSystem>(width, height, depth, 0.0001, 0.0001);
+    FluidManipulator manipulator(fluidSystem);
+    const Scalar dt = 0.05;
+    const int x = width / 2, y = height / 2, r = std::min(width, height) / 4;
+    manipulator.addDyeCircle(x, y, r, depth / 2, 1, 0.5, 0, 1, kAdditionConstantAdditive);
+    manipulator.addSoapCircle(x, y, r, 40, 10, kAdditionConstantAdditive);
+    for (int i = 0; i < 10; ++i) manipulator.step(dt);
+
+    // The same system split into two subdomains, e.g. one per socket
+    PartitionedFluidSystem partitioned(width, height, depth, 0.0001, 0.0001, 2);
+    std::vector<std::unique_ptr<FluidManipulator> > partitionManipulators;
+    std::vector<const DyeField *> partitionDyeSources;
+    std::vector<const VelocityField *> partitionFlowSources;
+    for (std::size_t s = 0; s < partitioned.subdomains.size(); ++s) {
+        FluidManipulator *partitionManipulator = new FluidManipulator(partitioned.subdomains[s]);
+        partitionManipulators.emplace_back(partitionManipulator);
+        const int partitionY = y - partitioned.layouts[s].rowOffset;
+        partitionManipulator->addDyeCircle(x, partitionY, r, depth / 2, 1, 0.5, 0, 1,
+                                           kAdditionConstantAdditive);
+        partitionManipulator->addSoapCircle(x, partitionY, r, 40, 10, kAdditionConstantAdditive);
+        partitionDyeSources.push_back(&partitionManipulator->dyeSource());
+        partitionFlowSources.push_back(&partitionManipulator->flowSource());
+    }
+    for (int i = 0; i < 10; ++i) partitioned.step(partitionDyeSources, partitionFlowSources, dt);
+
+    // The same system refined twice over where the dye and flow show detail
+    AdaptiveFluidSystem adaptive(width, height, depth, 0.0001, 0.0001);
+    FluidManipulator adaptiveManipulator(adaptive.base);
+    adaptiveManipulator.addDyeCircle(x, y, r, depth / 2, 1, 0.5, 0, 1, kAdditionConstantAdditive);
+    adaptiveManipulator.addSoapCircle(x, y, r, 40, 10, kAdditionConstantAdditive);
+    for (int i = 0; i < 10; ++i) {
+        adaptive.step(adaptiveManipulator.dyeSource(), adaptiveManipulator.flowSource(), dt);
+    }
+
+    // A parameter sweep over diffusion, viscosity, soap flux and timestep
+    const int ensembleSize = 8;
+    FluidEnsemble ensemble;
+    std::vector<std::unique_ptr<FluidManipulator> > ensembleManipulators;
+    for (int member = 0; member < ensembleSize; ++member) {
+        auto memberSystem = std::make_shared<FluidSystem>(width, height, depth,
+                                                          0.0001 * (1 + member % 2),
+                                                          0.0001 * (1 + member / 2 % 2));
+        FluidManipulator *memberManipulator = new FluidManipulator(memberSystem);
+        ensembleManipulators.emplace_back(memberManipulator);
+        memberManipulator->addDyeCircle(x, y, r, depth / 2, 1, 0.5, 0, 1,
+                                        kAdditionConstantAdditive);
+        memberManipulator->addSoapCircle(x, y, r, 20 * (1 + member / 4), 10,
+                                         kAdditionConstantAdditive);
+        ensemble.add(memberSystem, memberManipulator->dyeSource(),
+                     memberManipulator->flowSource(), dt * (1 + member % 2) / 2);
+    }
+
+    const Indices &dim = fluidSystem->dim;
+    DyeField added(fluidSystem->fullDim);
+    VelocityField gradient(fluidSystem->fullStaggeredDim);
+    Grid pressure, divergence, workspace;
+    allocateGrid(pressure, fluidSystem->fullDim);
+    allocateGrid(divergence, fluidSystem->fullDim);
+    allocateGrid(workspace, fluidSystem->fullDim);
+    div(divergence, fluidSystem->velocity, dim);
+    const Boundaries boundaries = {dim, nullptr};
+    // Where the manipulator's dye circle was stamped
+    SourceSpans spans(fluidSystem->fullDim);
+    spans.include({x - r, y - r, 1}, {x + r, y + r, depth / 2});
+
+    std::vector<Kernel> kernels = {
+        {"linearSolve", [&] {
+            linearSolve<Continuity>(pressure, divergence, workspace, Location::Ones(), 6, dim,
+                                    boundaries);
+        }},
+        {"linearSolve (gen.)", [&] {
+            setSpecializedKernels(false);
+            linearSolve<Continuity>(pressure, divergence, workspace, Location::Ones(), 6, dim,
+                                    boundaries);
+            setSpecializedKernels(true);
+        }},
+        {"grad", [&] { grad(gradient, pressure, dim); }},
+        {"div", [&] { div(divergence, fluidSystem->velocity, dim); }},
+        {"negate", [&] { parallelAssign(divergence, -1 * divergence, AssignOp()); }},
+        {"negatedDiv (fused)", [&] {
+            negatedDiv(divergence, fluidSystem->velocity, Location::Ones(), boundaries);
+        }},
+        {"setBoundaries", [&] { setBoundaries<Continuity>(divergence, boundaries); }},
+        {"field += field*dt", [&] { fluidSystem->density += added * dt; }},
+        {"field += sparse*dt", [&] {
+            for (std::size_t d = 0; d < DyeField::coords; ++d) {
+                spans.add(fluidSystem->density[d], added[d], dt);
+            }
+        }},
+        {"field -= field", [&] { fluidSystem->velocity -= gradient; }},
+        {"field *= scalar", [&] { added *= 1; }},
+        {"addDyeCircle", [&] {
+            manipulator.addDyeCircle(x, y, r, depth, 0, 0, 0, 0, kAdditionAdditive);
+        }},
+        {"FluidSystem::step", [&] { manipulator.step(dt); }},
+        {"step (unfused)", [&] {
+            fluidSystem->fusedStages = false;
+            manipulator.step(dt);
+            fluidSystem->fusedStages = true;
+        }},
+        {"step (generic)", [&] {
+            setSpecializedKernels(false);
+            manipulator.step(dt);
+            setSpecializedKernels(true);
+        }},
+        {"step (task graph)", [&] {
+            fluidSystem->schedule = FluidSystem::kScheduleTaskGraph;
+            manipulator.step(dt);
+            fluidSystem->schedule = FluidSystem::kScheduleDataParallel;
+        }},
+        {"step (2 subdomains)", [&] {
+            partitioned.step(partitionDyeSources, partitionFlowSources, dt);
+        }},
+        {"adaptive step", [&] {
+            adaptive.step(adaptiveManipulator.dyeSource(), adaptiveManipulator.flowSource(), dt);
+        }},
+        {"ensemble step (8)", [&] { ensemble.step(); }}
+    };
+    printSpeedupTable(kernels, repetitions);
+
+    const double unfusedBytes = estimatedStepBytes(*fluidSystem, false, false);
+    const double fusedBytes = estimatedStepBytes(*fluidSystem, true, false);
+    const double sparseBytes = estimatedStepBytes(*fluidSystem, true, true);
+    std::cout << std::endl << "Memory traffic per step, estimated from the passes over the "
+              << "grids (not measured): " << std::setprecision(2) << unfusedBytes / 1e6
+              << " MB unfused, " << fusedBytes / 1e6 << " MB fused ("
+              << std::setprecision(1) << 100 * (1 - fusedBytes / unfusedBytes)
+              << "% less), " << std::setprecision(2) << sparseBytes / 1e6
+              << " MB fused with sparse sources (" << std::setprecision(1)
+              << 100 * (1 - sparseBytes / unfusedBytes) << "% less)" << std::endl;
+
+    const double memberStepTime = time(kernels.back(), repetitions) / ensembleSize;
+    std::cout << std::endl << "Ensemble throughput: " << std::setprecision(0)
+              << (3600 * 1000 / memberStepTime) << " member-steps per hour ("
+              << std::setprecision(3) << memberStepTime << " ms per member-step)" << std::endl;
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include <mpi.h>
+
+#include "src/fluid-sim/distributedfluidsystem.h"
+#include "src/graphics/fluidmanipulator.h"
+
+// Headless driver for stepping a fluid system split across MPI ranks, e.g.
+//   mpirun -np 4 dye-transport-mpi 2048 2048 64 10
+// With --verify, rank 0 also steps the whole system on its own and reports the largest
+// difference from the distributed density. It should be at the level of float rounding:
+// backtraced positions are computed in the frame of each subdomain, so they round
+// differently than in the frame of the whole system.
+// Usage: dye-transport-mpi [width height depth [steps]] [--verify]
+
+namespace {
+
+const Scalar dt = 0.05;
+
+// Adds the same sources to a system, given the offset of its rows in the whole system
+void addSources(FluidManipulator &manipulator, Grid::Index width, Grid::Index height,
+                Grid::Index depth, Grid::Index rowOffset) {
+    const int x = width / 2, y = height / 2 - rowOffset;
+    const int r = std::min(width, height) / 4;
+    manipulator.addDyeCircle(x, y, r, depth / 2, 1, 0.5, 0, 1, kAdditionConstantAdditive);
+    manipulator.addSoapCircle(x, y, r, 40, 10, kAdditionConstantAdditive);
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    int rank, numRanks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &numRanks);
+
+    bool verify = false;
+    std::vector<char *> args;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--verify") == 0) verify = true;
+        else args.push_back(argv[i]);
+    }
+    Grid::Index width = 80, height = 80, depth = 6;
+    int steps = 20;
+    if (args.size() >= 3) {
+        width = std::atol(args[0]);
+        height = std::atol(args[1]);
+        depth = std::atol(args[2]);
+    }
+    if (args.size() >= 4) steps = std::atoi(args[3]);
+
+    DistributedFluidSystem system(MPI_COMM_WORLD, width, height, depth, 0.0001, 0.0001);
+    FluidManipulator manipulator(system.local);
+    addSources(manipulator, width, height, depth, system.layout.rowOffset);
+
+    std::vector<int> substeps;
+    MPI_Barrier(MPI_COMM_WORLD);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < steps; ++i) {
+        system.step(manipulator.dyeSource(), manipulator.flowSource(), dt);
+        substeps.push_back(system.substeps);
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+    auto stop = std::chrono::steady_clock::now();
+    const Scalar totalDensity = system.totalDensity();
+    const Scalar maxSpeed = system.maxSpeed();
+    if (rank == 0) {
+        std::cout << "Grid " << width << "x" << height << "x" << depth << " on "
+                  << numRanks << " ranks, halo width " << system.haloWidth << std::endl;
+        std::cout << steps << " steps: "
+                  << std::chrono::duration<double, std::milli>(stop - start).count() / steps
+                  << " ms/step, " << system.substeps << " substeps in the last step" << std::endl;
+        std::cout << "Total dye " << totalDensity << ", max speed " << maxSpeed << std::endl;
+    }
+
+    if (verify) {
+        DyeField gathered(rank == 0 ? TensorIndices({width + 2, height + 2, depth + 2})
+                                    : TensorIndices({0, 0, 0}));
+        system.gatherDensity(gathered);
+        if (rank == 0) {
+            auto reference = std::make_shared<FluidSystem>(width, height, depth, 0.0001, 0.0001);
+            FluidManipulator referenceManipulator(reference);
+            addSources(referenceManipulator, width, height, depth, 0);
+            for (int i = 0; i < steps; ++i) {
+                for (int substep = 0; substep < substeps[i]; ++substep) {
+                    referenceManipulator.step(dt / substeps[i]);
+                }
+            }
+            Scalar difference = 0;
+            for (std::size_t d = 0; d < DyeField::coords; ++d) {
+                Eigen::Tensor<Scalar, 0> maxDifference =
+                        (gathered[d] - reference->density[d]).abs().maximum();
+                difference = std::max(difference, maxDifference());
+            }
+            std::cout << "Max difference from a single system: " << difference << std::endl;
+        }
+    }
+
+    MPI_Finalize();
+    return 0;
+}
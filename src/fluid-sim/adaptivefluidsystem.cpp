@@ -0,0 +1,433 @@
+#include "adaptivefluidsystem.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "allocation.h"
+
+namespace {
+
+// Position in the frame of a coarse grid of fine cell f, along an axis of a patch whose
+// first coarse cell is first: of the cell's center, or of its first face if the values lie
+// on the faces normal to the axis, as those of a velocity component along it do
+Scalar coarsePosition(Grid::Index f, Grid::Index first, Grid::Index ratio, bool face) {
+    if (face) return first + static_cast<Scalar>(f - 1) / ratio;
+    return first - 1 + (f + (ratio - 1) / 2.0f) / ratio;
+}
+
+// Whether fine cell f lies within the coarse cells [coreBegin, coreEnd] along an axis of a
+// patch whose first coarse cell is first; for values on the faces normal to the axis, the
+// faces on either side of those cells count too
+bool withinCore(Grid::Index f, Grid::Index first, Grid::Index coreBegin, Grid::Index coreEnd,
+                Grid::Index ratio, bool face) {
+    const Grid::Index coarse = first + (f - 1) / ratio;
+    return coarse >= coreBegin &&
+           (coarse <= coreEnd || (face && coarse == coreEnd + 1 && (f - 1) % ratio == 0));
+}
+
+// Samples a coarse grid at the interior cells of a fine grid. Fine cells within
+// [coreBegin, coreEnd] (in coarse cells) are skipped if skipCore. The values of a velocity
+// component lie on the faces normal to its axis, and those of other grids (with an axis
+// of kGridDimensions) at the centers of the cells.
+void prolongGrid(Grid &fine, const Grid &coarse, const Indices &begin,
+                 const Indices &coreBegin, const Indices &coreEnd, Grid::Index ratio,
+                 bool skipCore, Grid::Index axis = kGridDimensions) {
+    Location minPosition = Location::Constant(0.5);
+    Location maxPosition = {static_cast<Scalar>(coarse.dimension(0)) - 1.5f,
+                            static_cast<Scalar>(coarse.dimension(1)) - 1.5f,
+                            static_cast<Scalar>(coarse.dimension(2)) - 1.5f};
+    // Faces run from the first wall to the last, as in resampleVelocity()
+    if (axis < kGridDimensions) {
+        minPosition(axis) = 0;
+        maxPosition(axis) = coarse.dimension(axis) - 2;
+    }
+#pragma omp parallel for collapse(2) schedule(static)
+    for (Grid::Index k = 1; k < fine.dimension(2) - 1; ++k) {
+        for (Grid::Index j = 1; j < fine.dimension(1) - 1; ++j) {
+            const bool coreRow = withinCore(j, begin(1), coreBegin(1), coreEnd(1), ratio,
+                                            axis == 1);
+            for (Grid::Index i = 1; i < fine.dimension(0) - 1; ++i) {
+                if (skipCore && coreRow &&
+                    withinCore(i, begin(0), coreBegin(0), coreEnd(0), ratio, axis == 0)) {
+                    continue;
+                }
+                Location x = {coarsePosition(i, begin(0), ratio, axis == 0),
+                              coarsePosition(j, begin(1), ratio, axis == 1),
+                              static_cast<Scalar>(k)};
+                x = x.min(maxPosition).max(minPosition);
+                fine(i, j, k) = interpolate(coarse, x);
+            }
+        }
+    }
+}
+
+// Sets the coarse values within [coreBegin, coreEnd] to the average of the fine ones they
+// cover: those of the fine cells within each coarse cell, or, for the values of a velocity
+// component along axis, those of the fine faces which lie on each coarse face
+void averageDownGrid(Grid &coarse, const Grid &fine, const Indices &begin,
+                     const Indices &coreBegin, const Indices &coreEnd, Grid::Index ratio,
+                     Grid::Index axis = kGridDimensions) {
+    // Faces on the far side of the core are covered too, and only z is not refined
+    const Grid::Index faceI = axis == 0, faceJ = axis == 1, faceK = axis == 2;
+    const Grid::Index spanI = faceI ? 1 : ratio, spanJ = faceJ ? 1 : ratio;
+    const Scalar weight = 1.0f / (spanI * spanJ);
+#pragma omp parallel for collapse(2) schedule(static)
+    for (Grid::Index k = coreBegin(2); k <= coreEnd(2) + faceK; ++k) {
+        for (Grid::Index j = coreBegin(1); j <= coreEnd(1) + faceJ; ++j) {
+            for (Grid::Index i = coreBegin(0); i <= coreEnd(0) + faceI; ++i) {
+                const Grid::Index fineI = (i - begin(0)) * ratio + 1;
+                const Grid::Index fineJ = (j - begin(1)) * ratio + 1;
+                Scalar sum = 0;
+                for (Grid::Index b = 0; b < spanJ; ++b) {
+                    for (Grid::Index a = 0; a < spanI; ++a) {
+                        sum += fine(fineI + a, fineJ + b, k);
+                    }
+                }
+                coarse(i, j, k) = weight * sum;
+            }
+        }
+    }
+}
+
+// Sets the boundaries of a velocity component along x or y, with Neumann conditions if
+// given, as a kernel
+template<int Axis>
+void setComponentBoundaries(Grid &component, bool neumann, const Boundaries &boundaries) {
+    if (neumann) {
+        setBoundaries<Neumann<Axis> >(component, boundaries);
+    } else {
+        setBoundaries<Continuity>(component, boundaries);
+    }
+}
+
+}
+
+AdaptiveFluidSystem::AdaptiveFluidSystem(Grid::Index width, Grid::Index height,
+                                         Grid::Index depth,
+                                         Scalar diffusionConstant, Scalar viscosity,
+                                         Grid::Index refinementRatio, Grid::Index blockSize) :
+    refinementRatio(refinementRatio), blockSize(blockSize),
+    fineFullDim({width * refinementRatio + 2, height * refinementRatio + 2, depth + 2}),
+    base(std::make_shared<FluidSystem>(width, height, depth, diffusionConstant, viscosity)),
+    blocksX((width + blockSize - 1) / blockSize),
+    blocksY((height + blockSize - 1) / blockSize) {
+    allocateGrid(pressure, base->fullVelocityDim);
+    allocateGrid(divergence, base->fullVelocityDim);
+    allocateGrid(pressureWorkspace, base->fullVelocityDim);
+}
+
+void AdaptiveFluidSystem::step(const DyeField &addedDensity,
+                               const VelocityField &addedVelocity, Scalar dt) {
+    if (stepsSinceRegrid % regridInterval == 0) regrid();
+    ++stepsSinceRegrid;
+
+    // The patches start from the base around their cores
+    for (Patch &patch : patches) {
+        prolong(patch, true);
+        for (std::size_t d = 0; d < DyeField::coords; ++d) {
+            prolongGrid((*patch.addedDensity)[d], addedDensity[d], patch.begin,
+                        patch.coreBegin, patch.coreEnd, refinementRatio, false);
+        }
+        for (std::size_t d = 0; d < VelocityField::coords; ++d) {
+            prolongGrid((*patch.addedVelocity)[d], addedVelocity[d], patch.begin,
+                        patch.coreBegin, patch.coreEnd, refinementRatio, false, d);
+        }
+    }
+
+    base->step(addedDensity, addedVelocity, dt);
+    FluidEnsemble ensemble;
+    for (Patch &patch : patches) {
+        ensemble.add(patch.system, *patch.addedDensity, *patch.addedVelocity, dt);
+    }
+    ensemble.step();
+
+    for (const Patch &patch : patches) averageDown(patch);
+    if (!patches.empty()) {
+        projectComposite();
+        base->requestVelocityUpdate();
+    }
+}
+
+void AdaptiveFluidSystem::regrid() {
+    const std::vector<char> flags = flagBlocks();
+    // Gather runs of flagged blocks along x into rectangles, extending the rectangle of
+    // the row below when a run spans the same blocks
+    struct Rectangle {
+        Grid::Index beginX, endX, beginY, endY;
+    };
+    std::vector<Rectangle> rectangles;
+    std::vector<std::size_t> open;
+    for (Grid::Index blockY = 0; blockY < blocksY; ++blockY) {
+        std::vector<std::size_t> stillOpen;
+        for (Grid::Index blockX = 0; blockX < blocksX; ++blockX) {
+            if (!flags[blockY * blocksX + blockX]) continue;
+            Grid::Index endX = blockX + 1;
+            while (endX < blocksX && flags[blockY * blocksX + endX]) ++endX;
+            auto below = std::find_if(open.begin(), open.end(), [&](std::size_t r) {
+                return rectangles[r].beginX == blockX && rectangles[r].endX == endX;
+            });
+            if (below != open.end()) {
+                rectangles[*below].endY = blockY + 1;
+                stillOpen.push_back(*below);
+            } else {
+                rectangles.push_back({blockX, endX, blockY, blockY + 1});
+                stillOpen.push_back(rectangles.size() - 1);
+            }
+            blockX = endX;
+        }
+        open.swap(stillOpen);
+    }
+
+    std::vector<Patch> refined;
+    for (const Rectangle &rectangle : rectangles) {
+        Patch patch = makePatch(rectangle.beginX, rectangle.endX,
+                                rectangle.beginY, rectangle.endY);
+        // Patches over the same blocks as before carry on
+        auto existing = std::find_if(patches.begin(), patches.end(), [&](const Patch &p) {
+            return (p.coreBegin == patch.coreBegin).all() && (p.coreEnd == patch.coreEnd).all();
+        });
+        if (existing != patches.end()) {
+            refined.push_back(*existing);
+        } else {
+            prolong(patch, false);
+            refined.push_back(patch);
+        }
+    }
+    patches.swap(refined);
+}
+
+void AdaptiveFluidSystem::compositeDensity(DyeField &density) const {
+    const Indices begin = {1, 1, 1};
+    const Indices end = base->dim;
+    for (std::size_t d = 0; d < DyeField::coords; ++d) {
+        prolongGrid(density[d], base->density[d], begin, begin, end, refinementRatio, false);
+    }
+    const Grid::Index r = refinementRatio;
+    for (const Patch &patch : patches) {
+        const Grid::Index offsetI = (patch.begin(0) - 1) * r, offsetJ = (patch.begin(1) - 1) * r;
+        for (std::size_t d = 0; d < DyeField::coords; ++d) {
+            const Grid &fine = patch.system->density[d];
+#pragma omp parallel for collapse(2) schedule(static)
+            for (Grid::Index k = 1; k <= base->dim(2); ++k) {
+                for (Grid::Index j = (patch.coreBegin(1) - 1) * r + 1;
+                     j <= patch.coreEnd(1) * r; ++j) {
+                    for (Grid::Index i = (patch.coreBegin(0) - 1) * r + 1;
+                         i <= patch.coreEnd(0) * r; ++i) {
+                        density[d](i, j, k) = fine(i - offsetI, j - offsetJ, k);
+                    }
+                }
+            }
+        }
+    }
+}
+
+std::vector<char> AdaptiveFluidSystem::flagBlocks() const {
+    const DyeField &density = base->density;
+    const VelocityField &u = base->velocity;
+    const Indices &dim = base->dim;
+    const Scalar maxGradient = gradientThreshold * gradientThreshold;
+    const Scalar maxVorticity = vorticityThreshold * vorticityThreshold;
+    std::vector<char> detailed(blocksX * blocksY, 0);
+#pragma omp parallel for collapse(2) schedule(dynamic, 1)
+    for (Grid::Index blockY = 0; blockY < blocksY; ++blockY) {
+        for (Grid::Index blockX = 0; blockX < blocksX; ++blockX) {
+            const Grid::Index iEnd = std::min((blockX + 1) * blockSize, dim(0));
+            const Grid::Index jEnd = std::min((blockY + 1) * blockSize, dim(1));
+            bool detail = false;
+            for (Grid::Index k = 1; k <= dim(2) && !detail; ++k) {
+                for (Grid::Index j = blockY * blockSize + 1; j <= jEnd && !detail; ++j) {
+                    for (Grid::Index i = blockX * blockSize + 1; i <= iEnd; ++i) {
+                        for (std::size_t d = 0; d < DyeField::coords; ++d) {
+                            const Scalar dx = density[d](i + 1, j, k) - density[d](i - 1, j, k);
+                            const Scalar dy = density[d](i, j + 1, k) - density[d](i, j - 1, k);
+                            const Scalar dz = density[d](i, j, k + 1) - density[d](i, j, k - 1);
+                            detail |= 0.25 * (dx * dx + dy * dy + dz * dz) > maxGradient;
+                        }
+                        const Scalar vorticityX = (u[2](i, j + 1, k) - u[2](i, j - 1, k)) -
+                                                  (u[1](i, j, k + 1) - u[1](i, j, k - 1));
+                        const Scalar vorticityY = (u[0](i, j, k + 1) - u[0](i, j, k - 1)) -
+                                                  (u[2](i + 1, j, k) - u[2](i - 1, j, k));
+                        const Scalar vorticityZ = (u[1](i + 1, j, k) - u[1](i - 1, j, k)) -
+                                                  (u[0](i, j + 1, k) - u[0](i, j - 1, k));
+                        detail |= 0.25 * (vorticityX * vorticityX + vorticityY * vorticityY +
+                                          vorticityZ * vorticityZ) > maxVorticity;
+                        if (detail) break;
+                    }
+                }
+            }
+            detailed[blockY * blocksX + blockX] = detail;
+        }
+    }
+
+    // Refine the neighbours too, so that features stay refined until the next regrid
+    std::vector<char> flags(blocksX * blocksY, 0);
+    for (Grid::Index blockY = 0; blockY < blocksY; ++blockY) {
+        for (Grid::Index blockX = 0; blockX < blocksX; ++blockX) {
+            if (!detailed[blockY * blocksX + blockX]) continue;
+            for (Grid::Index y = std::max<Grid::Index>(0, blockY - 1);
+                 y <= std::min(blocksY - 1, blockY + 1); ++y) {
+                for (Grid::Index x = std::max<Grid::Index>(0, blockX - 1);
+                     x <= std::min(blocksX - 1, blockX + 1); ++x) {
+                    flags[y * blocksX + x] = 1;
+                }
+            }
+        }
+    }
+    return flags;
+}
+
+AdaptiveFluidSystem::Patch AdaptiveFluidSystem::makePatch(Grid::Index beginX,
+                                                          Grid::Index endX,
+                                                          Grid::Index beginY,
+                                                          Grid::Index endY) const {
+    const Indices &dim = base->dim;
+    Patch patch;
+    patch.coreBegin = {beginX * blockSize + 1, beginY * blockSize + 1, 1};
+    patch.coreEnd = {std::min(endX * blockSize, dim(0)), std::min(endY * blockSize, dim(1)),
+                     dim(2)};
+    patch.begin = {std::max<Grid::Index>(1, patch.coreBegin(0) - margin),
+                   std::max<Grid::Index>(1, patch.coreBegin(1) - margin), 1};
+    patch.end = {std::min(dim(0), patch.coreEnd(0) + margin),
+                 std::min(dim(1), patch.coreEnd(1) + margin), dim(2)};
+
+    const Grid::Index r = refinementRatio;
+    patch.system = std::make_shared<FluidSystem>(
+            (patch.end(0) - patch.begin(0) + 1) * r, (patch.end(1) - patch.begin(1) + 1) * r,
+            dim(2), base->diffusionConstant, base->viscosity);
+    const Location refinement = {static_cast<Scalar>(r), static_cast<Scalar>(r), 1};
+    patch.system->spacing = base->spacing / refinement;
+    patch.system->solverIterations = base->solverIterations;
+    patch.system->advection = base->advection;
+    // Walls only on the sides where the patch meets those of the base; elsewhere the flow
+    // passes on
+    patch.system->horizontalNeumann = base->horizontalNeumann;
+    patch.system->verticalNeumann = base->verticalNeumann;
+    patch.system->openSides = {{{{patch.begin(0) > 1, patch.end(0) < dim(0)}},
+                                {{patch.begin(1) > 1, patch.end(1) < dim(1)}}}};
+    patch.addedDensity = std::make_shared<DyeField>(patch.system->fullDim);
+    patch.addedVelocity = std::make_shared<VelocityField>(patch.system->fullStaggeredDim);
+    return patch;
+}
+
+void AdaptiveFluidSystem::prolong(Patch &patch, bool skipCore) const {
+    FluidSystem &system = *patch.system;
+    for (std::size_t d = 0; d < DyeField::coords; ++d) {
+        prolongGrid(system.density[d], base->density[d], patch.begin, patch.coreBegin,
+                    patch.coreEnd, refinementRatio, skipCore);
+    }
+    for (std::size_t d = 0; d < VelocityField::coords; ++d) {
+        prolongGrid(system.velocity[d], base->velocity[d], patch.begin, patch.coreBegin,
+                    patch.coreEnd, refinementRatio, skipCore, d);
+    }
+    system.requestVelocityUpdate();
+}
+
+void AdaptiveFluidSystem::averageDown(const Patch &patch) {
+    const FluidSystem &system = *patch.system;
+    for (std::size_t d = 0; d < DyeField::coords; ++d) {
+        averageDownGrid(base->density[d], system.density[d], patch.begin, patch.coreBegin,
+                        patch.coreEnd, refinementRatio);
+    }
+    for (std::size_t d = 0; d < VelocityField::coords; ++d) {
+        averageDownGrid(base->velocity[d], system.velocity[d], patch.begin, patch.coreBegin,
+                        patch.coreEnd, refinementRatio, d);
+    }
+}
+
+void AdaptiveFluidSystem::projectComposite() {
+    const Indices &dim = base->velocityDim;
+    const Grid::Index columns = dim(0) + 2;
+    coreColumns.assign(columns * (dim(1) + 2), 0);
+    for (const Patch &patch : patches) {
+        for (Grid::Index j = patch.coreBegin(1); j <= patch.coreEnd(1); ++j) {
+            for (Grid::Index i = patch.coreBegin(0); i <= patch.coreEnd(0); ++i) {
+                coreColumns[j * columns + i] = 1;
+            }
+        }
+    }
+    auto core = [&](Grid::Index i, Grid::Index j) { return coreColumns[j * columns + i]; };
+    // The pressure is solved for in the cells outside of the cores; it is mirrored into the
+    // cores, as into the ghost cells, so the faces next to them keep their velocity
+    auto solved = [&](Grid::Index i, Grid::Index j, Grid::Index k) {
+        return i >= 1 && i <= dim(0) && j >= 1 && j <= dim(1) && k >= 1 && k <= dim(2) &&
+               !core(i, j);
+    };
+    const Location h = base->velocitySpacing();
+    const Location a = 1 / h.square();
+    const Location w = 0.5 / h;
+    VelocityField &u = base->velocity;
+    const Boundaries boundaries = {dim, nullptr};
+    const bool horizontalNeumann = base->horizontalNeumann;
+    const bool verticalNeumann = base->verticalNeumann;
+    const unsigned int iterations = base->solverIterations;
+
+#pragma omp parallel
+    {
+        // As in FluidSystem::project(), with the terms of the cells which are not solved
+        // for left out of the divergence and of the Jacobi iterations
+#pragma omp for collapse(2) schedule(static)
+        for (Grid::Index k = 0; k < dim(2) + 2; ++k) {
+            for (Grid::Index j = 0; j < dim(1) + 2; ++j) {
+                for (Grid::Index i = 0; i < dim(0) + 2; ++i) {
+                    pressure(i, j, k) = 0;
+                    if (!solved(i, j, k)) {
+                        divergence(i, j, k) = 0;
+                        continue;
+                    }
+                    divergence(i, j, k) = -(w(0) * (u[0](i + 1, j, k) - u[0](i - 1, j, k)) +
+                                            w(1) * (u[1](i, j + 1, k) - u[1](i, j - 1, k)) +
+                                            w(2) * (u[2](i, j, k + 1) - u[2](i, j, k - 1)));
+                }
+            }
+        }
+        Grid *source = &pressure, *target = &pressureWorkspace;
+        for (unsigned int iteration = 0; iteration < iterations; ++iteration) {
+            const Grid &p = *source;
+            Grid &next = *target;
+#pragma omp for collapse(2) schedule(static)
+            for (Grid::Index k = 1; k <= dim(2); ++k) {
+                for (Grid::Index j = 1; j <= dim(1); ++j) {
+                    for (Grid::Index i = 1; i <= dim(0); ++i) {
+                        if (!solved(i, j, k)) continue;
+                        Scalar sum = divergence(i, j, k), weight = 0;
+                        if (solved(i - 1, j, k)) { sum += a(0) * p(i - 1, j, k); weight += a(0); }
+                        if (solved(i + 1, j, k)) { sum += a(0) * p(i + 1, j, k); weight += a(0); }
+                        if (solved(i, j - 1, k)) { sum += a(1) * p(i, j - 1, k); weight += a(1); }
+                        if (solved(i, j + 1, k)) { sum += a(1) * p(i, j + 1, k); weight += a(1); }
+                        if (solved(i, j, k - 1)) { sum += a(2) * p(i, j, k - 1); weight += a(2); }
+                        if (solved(i, j, k + 1)) { sum += a(2) * p(i, j, k + 1); weight += a(2); }
+                        next(i, j, k) = weight > 0 ? sum / weight : 0;
+                    }
+                }
+            }
+            std::swap(source, target);
+        }
+        const Grid &p = *source;
+        auto mirrored = [&](Grid::Index i, Grid::Index j, Grid::Index k, Scalar centre) {
+            return solved(i, j, k) ? p(i, j, k) : centre;
+        };
+        // The faces on either side of a core cell hold the fine fluxes
+#pragma omp for collapse(2) schedule(static)
+        for (Grid::Index k = 1; k <= dim(2); ++k) {
+            for (Grid::Index j = 1; j <= dim(1); ++j) {
+                for (Grid::Index i = 1; i <= dim(0); ++i) {
+                    if (!solved(i, j, k)) continue;
+                    const Scalar centre = p(i, j, k);
+                    if (!core(i - 1, j)) {
+                        u[0](i, j, k) -= w(0) * (mirrored(i + 1, j, k, centre) -
+                                                 mirrored(i - 1, j, k, centre));
+                    }
+                    if (!core(i, j - 1)) {
+                        u[1](i, j, k) -= w(1) * (mirrored(i, j + 1, k, centre) -
+                                                 mirrored(i, j - 1, k, centre));
+                    }
+                    u[2](i, j, k) -= w(2) * (mirrored(i, j, k + 1, centre) -
+                                             mirrored(i, j, k - 1, centre));
+                }
+            }
+        }
+        setComponentBoundaries<0>(u[0], horizontalNeumann, boundaries);
+        setComponentBoundaries<1>(u[1], verticalNeumann, boundaries);
+        setBoundaries<Neumann<2> >(u[2], boundaries);
+    }
+}
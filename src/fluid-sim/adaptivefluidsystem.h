@@ -0,0 +1,88 @@
+#ifndef ADAPTIVEFLUIDSYSTEM_H
+#define ADAPTIVEFLUIDSYSTEM_H
+
+#include <memory>
+#include <vector>
+
+#include "fluidsystem.h"
+#include "fluidensemble.h"
+
+// Refines a coarse base system with finer patches where the flow shows detail. The base
+// grid is tiled by square blocks of columns (spanning the depth), and every regridInterval
+// steps the blocks whose dye gradient or vorticity exceeds a threshold are gathered into
+// rectangles, each covered by a patch: a FluidSystem refinementRatio times finer in x and
+// y over the rectangle and a margin of coarse cells around it.
+//
+// Every step, the margins of the patches are refilled by interpolating the base at the
+// start of the step, the base and the patches are stepped, and the core of each patch is
+// averaged down into the base. The base is then projected again as a composite of both
+// levels: the velocity on the faces within and around the cores is that of the fine faces
+// on them, and only the pressure of the cells outside of the cores is solved for, so that
+// the coarse flow around the patches matches the fine fluxes through their edges. The
+// patches see the coarse flow around them through their margins, which keep the patches'
+// own boundary conditions away from their cores. Semi-Lagrangian advection has no face
+// fluxes to match between levels, so dye is only kept consistent by the averaging.
+class AdaptiveFluidSystem
+{
+public:
+    AdaptiveFluidSystem(Grid::Index width, Grid::Index height, Grid::Index depth,
+                        Scalar diffusionConstant = 0, Scalar viscosity = 0,
+                        Grid::Index refinementRatio = 2, Grid::Index blockSize = 8);
+
+    const Grid::Index refinementRatio;
+    const Grid::Index blockSize;
+    // Dimensions of the whole system at the resolution of the patches
+    const TensorIndices fineFullDim;
+
+    // Coarse cells around the blocks of a patch which it also covers
+    Grid::Index margin = 2;
+    // Blocks are refined where any dye channel changes by more than gradientThreshold per
+    // coarse cell, or the vorticity exceeds vorticityThreshold per unit time
+    Scalar gradientThreshold = 0.1;
+    Scalar vorticityThreshold = 4;
+    // Steps between regrids, so fronts should not move more than a block in this many
+    int regridInterval = 10;
+
+    std::shared_ptr<FluidSystem> base;
+
+    struct Patch {
+        // Coarse cells covered by the patch, and those of its blocks, inclusive
+        Indices begin, end, coreBegin, coreEnd;
+        std::shared_ptr<FluidSystem> system;
+        // The base sources, sampled at the patch's cells
+        std::shared_ptr<DyeField> addedDensity;
+        std::shared_ptr<VelocityField> addedVelocity;
+    };
+    std::vector<Patch> patches;
+
+    // Sources are those of the base. Must be called outside of parallel regions.
+    void step(const DyeField &addedDensity, const VelocityField &addedVelocity, Scalar dt);
+    // Places patches over the blocks which need them now; step() calls this every
+    // regridInterval steps
+    void regrid();
+
+    // Samples the base at the resolution of the patches, and copies in the patch cores;
+    // density must have dimensions fineFullDim
+    void compositeDensity(DyeField &density) const;
+
+private:
+    int stepsSinceRegrid = 0;
+    const Grid::Index blocksX, blocksY;
+
+    // Whether each block needs refinement, row by row
+    std::vector<char> flagBlocks() const;
+    // Covers the blocks within [beginX, endX) x [beginY, endY)
+    Patch makePatch(Grid::Index beginX, Grid::Index endX,
+                    Grid::Index beginY, Grid::Index endY) const;
+    // Samples the base's grids at the cells of a patch, outside of its core if skipCore
+    void prolong(Patch &patch, bool skipCore) const;
+    void averageDown(const Patch &patch);
+    // Projects the velocity of the base with that on the faces of the patch cores held
+    void projectComposite();
+    // Workspaces of projectComposite(), and whether each column of base cells (with ghost
+    // cells) lies within the core of a patch
+    Grid pressure, divergence, pressureWorkspace;
+    std::vector<char> coreColumns;
+};
+
+#endif // ADAPTIVEFLUIDSYSTEM_H
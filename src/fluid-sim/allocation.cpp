@@ -0,0 +1,96 @@
+#include "allocation.h"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <omp.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+AllocationPolicy policy = {true, kHugePagesNone};
+
+void adviseHugePages(Grid &grid) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    static bool supported = true;
+    if (!supported) return;
+    const std::uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+    std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(grid.data());
+    std::uintptr_t end = reinterpret_cast<std::uintptr_t>(grid.data() + grid.size());
+    begin = (begin + pageSize - 1) & ~(pageSize - 1);
+    end = end & ~(pageSize - 1);
+    if (end <= begin) return;
+    if (madvise(reinterpret_cast<void *>(begin), end - begin, MADV_HUGEPAGE) != 0) {
+        // Fall back to regular pages, e.g. if the kernel was built without THP
+        supported = false;
+    }
+#else
+    (void) grid;
+#endif
+}
+
+}
+
+void setAllocationPolicy(const AllocationPolicy &newPolicy) {
+    policy = newPolicy;
+}
+const AllocationPolicy &allocationPolicy() {
+    return policy;
+}
+
+void allocateGrid(Grid &grid, const TensorIndices &dimensions) {
+    // Resizing allocates without touching, so pages are not placed until zeroGrid
+    grid.resize(dimensions);
+    if (policy.hugePages == kHugePagesTransparent) adviseHugePages(grid);
+    zeroGrid(grid);
+}
+
+void zeroGrid(Grid &grid) {
+    if (omp_get_level() == 0) {
+        if (!policy.parallelFirstTouch) {
+            grid.setZero();
+            return;
+        }
+#pragma omp parallel
+        zeroGrid(grid);
+        return;
+    }
+    const Grid::Index rowLength = grid.dimension(0);
+    const Grid::Index planeLength = rowLength * grid.dimension(1);
+    Grid::Index begin, end;
+    threadYRows(grid, begin, end);
+    for (Grid::Index k = 0; k < grid.dimension(2); ++k) {
+        std::memset(grid.data() + k * planeLength + begin * rowLength, 0,
+                    (end - begin) * rowLength * sizeof(Scalar));
+    }
+#pragma omp barrier
+}
+
+void reportThreadBinding(std::ostream &out) {
+    static const char *bindNames[] = {"false", "true", "master", "close", "spread"};
+    const int bind = omp_get_proc_bind();
+    out << "OpenMP: " << omp_get_max_threads() << " threads, proc_bind="
+        << (bind >= 0 && bind <= 4 ? bindNames[bind] : "unknown")
+        << ", " << omp_get_num_places() << " places" << std::endl;
+    std::vector<int> cpus(omp_get_max_threads(), -1);
+#pragma omp parallel
+    {
+#ifdef __linux__
+        cpus[omp_get_thread_num()] = sched_getcpu();
+#endif
+    }
+    out << "  Thread CPUs:";
+    for (std::size_t t = 0; t < cpus.size(); ++t) {
+        out << " " << t << "->" << cpus[t];
+    }
+    out << std::endl;
+    out << "  Grid allocation: "
+        << (policy.parallelFirstTouch ? "parallel first-touch" : "serial")
+        << (policy.hugePages == kHugePagesTransparent ? ", transparent huge pages" : "")
+        << std::endl;
+}
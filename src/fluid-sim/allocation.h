@@ -0,0 +1,39 @@
+#ifndef ALLOCATION_H
+#define ALLOCATION_H
+
+#include <ostream>
+
+#include "math.h"
+
+// Placement of grid memory on multi-socket machines.
+//
+// Kernels split the y rows (j) of grids across threads with a static schedule, and sweep
+// every plane (k) of each row, with i innermost (Eigen tensors are column-major, so i is
+// contiguous). Pages land on the NUMA node of the thread that first writes them, so
+// zero-filling fields with the same partition, threadYRows(), keeps each thread's rows
+// in local memory.
+
+enum HugePageMode {
+    kHugePagesNone,
+    kHugePagesTransparent // madvise(MADV_HUGEPAGE) before first touch
+};
+
+struct AllocationPolicy {
+    bool parallelFirstTouch;
+    HugePageMode hugePages;
+};
+
+void setAllocationPolicy(const AllocationPolicy &policy);
+const AllocationPolicy &allocationPolicy();
+
+// Allocates a zero-filled grid according to the allocation policy; not a kernel, so it
+// must be called outside of parallel regions
+void allocateGrid(Grid &grid, const TensorIndices &dimensions);
+// Zero-fills a grid, touching each row from the thread which sweeps it in kernels, to
+// within a row for staggered grids (a kernel in the sense of math.h)
+void zeroGrid(Grid &grid);
+
+// Prints OpenMP thread count, binding policy and the CPU each thread runs on
+void reportThreadBinding(std::ostream &out);
+
+#endif // ALLOCATION_H
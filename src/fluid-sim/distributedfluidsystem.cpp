@@ -0,0 +1,150 @@
+#include "distributedfluidsystem.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+static_assert(sizeof(Scalar) == sizeof(float), "Halo exchanges send grids as MPI_FLOAT");
+
+namespace {
+
+int commRank(MPI_Comm communicator) {
+    int rank;
+    MPI_Comm_rank(communicator, &rank);
+    return rank;
+}
+int commSize(MPI_Comm communicator) {
+    int size;
+    MPI_Comm_size(communicator, &size);
+    return size;
+}
+
+// A block of consecutive rows across all depth slices of a grid
+MPI_Datatype rowBlockType(const Grid &grid, Grid::Index numRows) {
+    const Grid::Dimensions &d = grid.dimensions();
+    MPI_Datatype type;
+    MPI_Type_vector(d[2], d[0] * numRows, d[0] * d[1], MPI_FLOAT, &type);
+    MPI_Type_commit(&type);
+    return type;
+}
+
+}
+
+DistributedFluidSystem::DistributedFluidSystem(MPI_Comm communicator,
+                                               Grid::Index width, Grid::Index height,
+                                               Grid::Index depth,
+                                               Scalar diffusionConstant, Scalar viscosity,
+                                               Grid::Index haloWidth) :
+    globalHeight(height), haloWidth(haloWidth),
+    layout(slabLayout(height, commSize(communicator), commRank(communicator), haloWidth)),
+    communicator(communicator), rank(commRank(communicator)),
+    numRanks(commSize(communicator)) {
+    if (haloWidth < 2 || height / numRanks < haloWidth + 2) {
+        throw std::invalid_argument("Each rank must own at least haloWidth + 2 >= 4 rows");
+    }
+
+    local = std::make_shared<FluidSystem>(width, layout.height, depth,
+                                          diffusionConstant, viscosity);
+    local->exchangeHalos = std::bind(&DistributedFluidSystem::exchangeHalos, this,
+                                     std::placeholders::_1);
+}
+
+void DistributedFluidSystem::step(const DyeField &addedDensity,
+                                  const VelocityField &addedVelocity, Scalar dt) {
+    // Bound how far a backtrace can reach by the speed once the sources are added
+    Scalar speeds[2] = {maxAbs(local->velocity), maxAbs(addedVelocity)};
+    MPI_Allreduce(MPI_IN_PLACE, speeds, 2, MPI_FLOAT, MPI_MAX, communicator);
+    substeps = slabSubsteps(layout, dt * (speeds[0] + dt * speeds[1]));
+    for (int substep = 0; substep < substeps; ++substep) {
+        local->step(addedDensity, addedVelocity, dt / substeps);
+    }
+}
+
+Scalar DistributedFluidSystem::maxSpeed() const {
+    Scalar speed = maxAbs(local->velocity);
+    MPI_Allreduce(MPI_IN_PLACE, &speed, 1, MPI_FLOAT, MPI_MAX, communicator);
+    return speed;
+}
+
+Scalar DistributedFluidSystem::totalDensity() const {
+    double sum = 0;
+    for (std::size_t d = 0; d < DyeField::coords; ++d) {
+        sum += sumOwnedInterior(layout, local->density[d]);
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &sum, 1, MPI_DOUBLE, MPI_SUM, communicator);
+    return sum;
+}
+
+void DistributedFluidSystem::gatherDensity(DyeField &density, int root) const {
+    // Besides its owned rows, the first and last ranks hold the outer ghost rows
+    for (std::size_t d = 0; d < DyeField::coords; ++d) {
+        const Grid &grid = local->density[d];
+        const Grid::Index rowLength = grid.dimension(0);
+        if (rank != root) {
+            const Grid::Index begin = layout.first ? 0 : layout.ownedBegin;
+            const Grid::Index end = layout.last ? layout.ownedEnd + 1 : layout.ownedEnd;
+            MPI_Datatype type = rowBlockType(grid, end - begin);
+            MPI_Send(grid.data() + begin * rowLength, 1, type, root, 0, communicator);
+            MPI_Type_free(&type);
+            continue;
+        }
+        for (int source = 0; source < numRanks; ++source) {
+            const SlabLayout sourceLayout = slabLayout(globalHeight, numRanks, source, haloWidth);
+            Grid::Index globalBegin = sourceLayout.globalBegin;
+            Grid::Index numRows = sourceLayout.numRows;
+            if (source == 0) {
+                --globalBegin;
+                ++numRows;
+            }
+            if (source == numRanks - 1) ++numRows;
+            if (source == rank) {
+                copyRows(grid, globalBegin - layout.rowOffset, density[d], globalBegin, numRows);
+                continue;
+            }
+            MPI_Datatype type = rowBlockType(density[d], numRows);
+            MPI_Recv(density[d].data() + globalBegin * rowLength, 1, type, source, 0,
+                     communicator, MPI_STATUS_IGNORE);
+            MPI_Type_free(&type);
+        }
+    }
+}
+
+void DistributedFluidSystem::exchangeHalos(Grid &grid) const {
+    if (omp_get_level() == 0) {
+        exchangeRows(grid);
+        return;
+    }
+    // MPI is only called from the master thread, once the team has finished the grid
+#pragma omp barrier
+#pragma omp master
+    exchangeRows(grid);
+#pragma omp barrier
+}
+
+void DistributedFluidSystem::exchangeRows(Grid &grid) const {
+    const Grid::Index rowLength = grid.dimension(0);
+    const int lower = layout.first ? MPI_PROC_NULL : rank - 1;
+    const int upper = layout.last ? MPI_PROC_NULL : rank + 1;
+
+    // The top owned rows of each rank fill the rows below ownedBegin of the next rank
+    const Grid::Index upwardRows = lowerHaloRows(layout);
+    MPI_Datatype upward = rowBlockType(grid, upwardRows);
+    MPI_Sendrecv(grid.data() + (layout.ownedEnd - upwardRows) * rowLength, 1, upward,
+                 upper, 0, grid.data(), 1, upward, lower, 0, communicator, MPI_STATUS_IGNORE);
+    MPI_Type_free(&upward);
+
+    // The bottom owned rows of each rank fill the rows from ownedEnd of the previous rank
+    const Grid::Index downwardRows = upperHaloRows(layout, grid);
+    MPI_Datatype downward = rowBlockType(grid, downwardRows);
+    MPI_Sendrecv(grid.data() + layout.ownedBegin * rowLength, 1, downward, lower, 1,
+                 grid.data() + layout.ownedEnd * rowLength, 1, downward, upper, 1,
+                 communicator, MPI_STATUS_IGNORE);
+    MPI_Type_free(&downward);
+}
+
+Scalar DistributedFluidSystem::maxAbs(const VelocityField &field) const {
+    Scalar result = 0;
+    for (std::size_t d = 0; d < VelocityField::coords; ++d) {
+        result = std::max(result, maxAbsOwned(layout, field[d]));
+    }
+    return result;
+}
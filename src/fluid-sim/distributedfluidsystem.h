@@ -0,0 +1,61 @@
+#ifndef DISTRIBUTEDFLUIDSYSTEM_H
+#define DISTRIBUTEDFLUIDSYSTEM_H
+
+#include <memory>
+
+#include <mpi.h>
+
+#include "fluidsystem.h"
+#include "slab.h"
+
+// Splits a fluid system across the ranks of an MPI communicator into slabs of rows
+// along the y axis, so that grids larger than one node's memory can be stepped.
+//
+// Each rank steps the slab of a SlabLayout. Whenever the local system sets the
+// boundaries of a field, the rows outside of those owned by the rank are then refilled
+// from the neighbours, so every owned row evolves as it would in a single system.
+// Backtraces of owned rows stay within the overlap as long as no velocity moves more
+// than haloWidth - 1 cells per step, which step() ensures by substepping.
+class DistributedFluidSystem
+{
+public:
+    // Collective over the communicator. Every rank must own at least haloWidth + 2 rows.
+    DistributedFluidSystem(MPI_Comm communicator,
+                           Grid::Index width, Grid::Index height, Grid::Index depth,
+                           Scalar diffusionConstant = 0, Scalar viscosity = 0,
+                           Grid::Index haloWidth = 3);
+    // The local system calls back into this object
+    DistributedFluidSystem(const DistributedFluidSystem &) = delete;
+    DistributedFluidSystem &operator=(const DistributedFluidSystem &) = delete;
+
+    const Grid::Index globalHeight;
+    const Grid::Index haloWidth;
+
+    // The subdomain of this rank
+    const SlabLayout layout;
+    std::shared_ptr<FluidSystem> local;
+
+    // Number of substeps taken by the last call to step()
+    int substeps = 1;
+
+    // Collective. Sources are in the local frame, as for the local system.
+    void step(const DyeField &addedDensity, const VelocityField &addedVelocity, Scalar dt);
+
+    // Collective reductions over the whole system
+    Scalar maxSpeed() const;
+    Scalar totalDensity() const;
+    // Collective. Copies the density of the whole system into density on the root rank,
+    // whose dimensions must be those of a FluidSystem of the full size.
+    void gatherDensity(DyeField &density, int root = 0) const;
+
+private:
+    MPI_Comm communicator;
+    int rank, numRanks;
+
+    // Exchanges rows with both neighbours (a kernel in the sense of math.h)
+    void exchangeHalos(Grid &grid) const;
+    void exchangeRows(Grid &grid) const;
+    Scalar maxAbs(const VelocityField &field) const;
+};
+
+#endif // DISTRIBUTEDFLUIDSYSTEM_H
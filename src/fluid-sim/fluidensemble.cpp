@@ -0,0 +1,32 @@
+#include "fluidensemble.h"
+
+#include <algorithm>
+
+#include <omp.h>
+
+#include "taskgraph.h"
+
+void FluidEnsemble::add(const std::shared_ptr<FluidSystem> &system,
+                        const DyeField &addedDensity, const VelocityField &addedVelocity,
+                        Scalar dt) {
+    members.push_back({system, &addedDensity, &addedVelocity, dt});
+}
+
+void FluidEnsemble::step() {
+    if (members.empty()) return;
+    const int numThreads = omp_get_max_threads();
+    const int numTeams = std::min<int>(numThreads, members.size());
+    const int threadsPerMember = std::max(1, numThreads / numTeams);
+    // Members with their own teams need nested parallelism
+    NestedParallelism nesting;
+#pragma omp parallel num_threads(numTeams)
+    {
+        omp_set_num_threads(threadsPerMember);
+        // Members may differ in size, so they are handed out dynamically
+#pragma omp for schedule(dynamic, 1)
+        for (std::size_t i = 0; i < members.size(); ++i) {
+            const Member &member = members[i];
+            member.system->step(*member.addedDensity, *member.addedVelocity, member.dt);
+        }
+    }
+}
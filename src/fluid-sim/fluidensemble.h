@@ -0,0 +1,36 @@
+#ifndef FLUIDENSEMBLE_H
+#define FLUIDENSEMBLE_H
+
+#include <memory>
+#include <vector>
+
+#include "fluidsystem.h"
+
+// Advances many independent fluid systems in lockstep, e.g. for parameter sweeps. Each
+// member has its own parameters (those of its FluidSystem), sources and timestep.
+//
+// Small grids leave most of a team idle in the barriers between kernels, so members are
+// shared among the threads instead: with at least as many members as threads, each member
+// is stepped whole by a single thread; with fewer, each member gets its own team.
+class FluidEnsemble
+{
+public:
+    struct Member {
+        std::shared_ptr<FluidSystem> system;
+        const DyeField *addedDensity;
+        const VelocityField *addedVelocity;
+        Scalar dt;
+    };
+
+    // The sources are referenced, not copied, so they may be changed between steps
+    void add(const std::shared_ptr<FluidSystem> &system, const DyeField &addedDensity,
+             const VelocityField &addedVelocity, Scalar dt);
+
+    std::vector<Member> members;
+
+    // Steps every member once by its own timestep, allowing nested parallel regions for
+    // its length. Must be called outside of parallel regions.
+    void step();
+};
+
+#endif // FLUIDENSEMBLE_H
@@ -2,20 +2,187 @@
 
 #include <utility>
 #include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+#include "taskgraph.h"
+
+namespace {
+
+Grid::Index checkVelocityScale(Grid::Index width, Grid::Index height, Grid::Index scale) {
+    if (scale < 1 || width % scale || height % scale) {
+        throw std::invalid_argument("The velocity scale must divide the width and height");
+    }
+    return scale;
+}
+
+// Cells of an axis of n cells overlapping each of m cells over the same extent: the first
+// of them, and the fraction of the m-cell which each covers
+struct Overlap {
+    Grid::Index first;
+    std::vector<Scalar> fractions;
+};
+std::vector<Overlap> overlaps(Grid::Index n, Grid::Index m) {
+    std::vector<Overlap> result(m);
+    const double width = static_cast<double>(n) / m;
+    for (Grid::Index c = 0; c < m; ++c) {
+        const double begin = c * width, end = (c + 1) * width;
+        Overlap &overlap = result[c];
+        overlap.first = static_cast<Grid::Index>(begin) + 1;
+        for (Grid::Index cell = overlap.first; cell - 1 < end && cell <= n; ++cell) {
+            const double covered = std::min<double>(end, cell) -
+                                   std::max<double>(begin, cell - 1);
+            overlap.fractions.push_back(covered / width);
+        }
+    }
+    return result;
+}
+
+}
+
+SourceSpans::SourceSpans(const TensorIndices &dimensions) {
+    reset(dimensions);
+}
+
+void SourceSpans::include(const Indices &begin, const Indices &end) {
+    const Grid::Index iBegin = std::max<Grid::Index>(begin(0), 0);
+    const Grid::Index iEnd = std::min<Grid::Index>(end(0), dimensions[0] - 1);
+    if (iBegin > iEnd) return;
+    for (Grid::Index k = std::max<Grid::Index>(begin(2), 0);
+         k <= std::min<Grid::Index>(end(2), dimensions[2] - 1); ++k) {
+        for (Grid::Index j = std::max<Grid::Index>(begin(1), 0);
+             j <= std::min<Grid::Index>(end(1), dimensions[1] - 1); ++j) {
+            const Grid::Index row = j + k * dimensions[1];
+            Span &span = spans[row];
+            if (span.begin > span.end) {
+                span = {iBegin, iEnd};
+                rows.push_back(row);
+            } else {
+                span.begin = std::min(span.begin, iBegin);
+                span.end = std::max(span.end, iEnd);
+            }
+        }
+    }
+}
+void SourceSpans::include(const Grid &grid) {
+    for (Grid::Index k = 0; k < dimensions[2]; ++k) {
+        for (Grid::Index j = 0; j < dimensions[1]; ++j) {
+            Grid::Index begin = dimensions[0], end = -1;
+            for (Grid::Index i = 0; i < dimensions[0]; ++i) {
+                if (grid(i, j, k) == 0) continue;
+                begin = std::min(begin, i);
+                end = i;
+            }
+            include({begin, j, k}, {end, j, k});
+        }
+    }
+}
+void SourceSpans::clear() {
+    for (Grid::Index row : rows) spans[row] = {1, 0};
+    rows.clear();
+}
+void SourceSpans::reset(const TensorIndices &dimensions) {
+    this->dimensions = dimensions;
+    spans.assign(dimensions[1] * dimensions[2], {1, 0});
+    rows.clear();
+}
+
+void SourceSpans::add(Grid &out, const Grid &source, Scalar scale) const {
+    if (omp_get_level() == 0) {
+#pragma omp parallel
+        add(out, source, scale);
+        return;
+    }
+    const Grid::Index rowLength = dimensions[0];
+    const Grid::Index numRows = rows.size();
+    Scalar *values = out.data();
+    const Scalar *added = source.data();
+#pragma omp for schedule(static)
+    for (Grid::Index r = 0; r < numRows; ++r) {
+        const Span &span = spans[rows[r]];
+        const Grid::Index offset = rows[r] * rowLength;
+        for (Grid::Index n = offset + span.begin; n <= offset + span.end; ++n) {
+            values[n] = values[n] + added[n] * scale;
+        }
+    }
+}
 
 FluidSystem::FluidSystem(Grid::Index width, Grid::Index height, Grid::Index depth,
-                         Scalar diffusionConstant, Scalar viscosity) :
-    dim({width, height, depth}), staggeredDim(dim + 1),
+                         Scalar diffusionConstant, Scalar viscosity,
+                         Grid::Index velocityScale) :
+    velocityScale(checkVelocityScale(width, height, velocityScale)),
+    dim({width, height, depth}),
+    velocityDim({width / velocityScale, height / velocityScale, depth}),
+    staggeredDim(velocityDim + 1),
     fullDim({width + 2, height + 2, depth + 2}),
-    fullStaggeredDim({width + 3, height + 3, depth + 3}),
+    fullVelocityDim({velocityDim(0) + 2, velocityDim(1) + 2, depth + 2}),
+    fullStaggeredDim({velocityDim(0) + 3, velocityDim(1) + 3, depth + 3}),
     diffusionConstant(diffusionConstant), viscosity(viscosity),
     density(fullDim), velocity(fullStaggeredDim),
-    densityPrev(fullDim), velocityPrev(fullStaggeredDim) {}
+    densityPrev(fullDim), velocityPrev(fullStaggeredDim),
+    densityCompensation(fullDim), velocityCompensation(fullStaggeredDim),
+    densityWorkspace(fullDim), velocityWorkspace(fullStaggeredDim),
+    gradient(fullStaggeredDim) {
+    phaseTimes.fill(0);
+    allocateGrid(pressure, fullVelocityDim);
+    allocateGrid(divergence, fullVelocityDim);
+    allocateGrid(pressureWorkspace, fullVelocityDim);
+}
 
 void FluidSystem::step(const DyeField &addedDensity, const VelocityField &addedVelocity,
                        Scalar dt) {
-    stepVelocity(dt, addedVelocity);
-    stepDensity(dt, addedDensity);
+    if (velocityUpdateRequested || &addedVelocity != lastAddedVelocity) {
+        velocityAtRest = false;
+    }
+    ++heldSteps;
+    heldTime += dt;
+    Scalar velocityDt = 0;
+    if (velocityAtRest) {
+        heldSteps = 0;
+        heldTime = 0;
+    } else if (heldSteps >= velocityInterval || velocityUpdateRequested ||
+               &addedVelocity != lastAddedVelocity) {
+        velocityDt = heldTime;
+        heldSteps = 0;
+        heldTime = 0;
+        velocityUpdateRequested = false;
+        lastAddedVelocity = &addedVelocity;
+    }
+    densityDiffusion = diffusionScheme(diffusionConstant, dt, spacing);
+    if (velocityDt) velocityDiffusion = diffusionScheme(viscosity, velocityDt, velocitySpacing());
+
+    if (schedule == kScheduleTaskGraph) {
+        stepTaskGraph(dt, velocityDt, addedDensity, addedVelocity);
+    } else {
+        // One parallel region for the whole step, instead of one per kernel call
+#pragma omp parallel if(dim.prod() >= parallelThreshold)
+        {
+            if (velocityDt) stepVelocity(velocityDt, addedVelocity);
+            stepDensity(dt, addedDensity);
+        }
+    }
+    if (velocityDt) {
+        checkRest(addedVelocity);
+        if (adaptiveVelocityInterval) adaptVelocityInterval();
+    }
+}
+
+void FluidSystem::setSourceSpans(const DyeField &source, const SourceSpans *spans) {
+    if (!spans && &source != sparseDensitySource) return;
+    sparseDensitySource = spans ? &source : nullptr;
+    densitySourceSpans = spans;
+}
+void FluidSystem::setSourceSpans(const VelocityField &source, const SourceSpans *spans) {
+    if (!spans && &source != sparseVelocitySource) return;
+    sparseVelocitySource = spans ? &source : nullptr;
+    velocitySourceSpans = spans;
+}
+const SourceSpans *FluidSystem::sourceSpans(const DyeField &source) const {
+    return &source == sparseDensitySource ? densitySourceSpans : nullptr;
+}
+const SourceSpans *FluidSystem::sourceSpans(const VelocityField &source) const {
+    return &source == sparseVelocitySource ? velocitySourceSpans : nullptr;
 }
 
 void FluidSystem::clear() {
@@ -23,90 +190,613 @@ void FluidSystem::clear() {
     velocity.clear();
     densityPrev.clear();
     velocityPrev.clear();
+    requestVelocityUpdate();
+}
+
+void FluidSystem::requestVelocityUpdate() {
+    velocityUpdateRequested = true;
+}
+
+void FluidSystem::resample(Grid::Index width, Grid::Index height, Grid::Index depth) {
+    checkVelocityScale(width, height, velocityScale);
+    const Indices oldDim = dim, oldVelocityDim = velocityDim;
+    const Indices newDim = {width, height, depth};
+    spacing *= oldDim.cast<Scalar>() / newDim.cast<Scalar>();
+    dim = newDim;
+    velocityDim = {width / velocityScale, height / velocityScale, depth};
+    staggeredDim = velocityDim + 1;
+    fullDim = {width + 2, height + 2, depth + 2};
+    fullVelocityDim = {velocityDim(0) + 2, velocityDim(1) + 2, depth + 2};
+    fullStaggeredDim = {velocityDim(0) + 3, velocityDim(1) + 3, depth + 3};
+
+    DyeField oldDensity(std::move(density));
+    VelocityField oldVelocity(std::move(velocity));
+    density = DyeField(fullDim);
+    velocity = VelocityField(fullStaggeredDim);
+    densityPrev = DyeField(fullDim);
+    velocityPrev = VelocityField(fullStaggeredDim);
+    densityCompensation = DyeField(fullDim);
+    velocityCompensation = VelocityField(fullStaggeredDim);
+    densityWorkspace = DyeField(fullDim);
+    velocityWorkspace = VelocityField(fullStaggeredDim);
+    gradient = VelocityField(fullStaggeredDim);
+    allocateGrid(pressure, fullVelocityDim);
+    allocateGrid(divergence, fullVelocityDim);
+    allocateGrid(pressureWorkspace, fullVelocityDim);
+
+    const Boundaries boundaries = densityBoundaries();
+    for (std::size_t d = 0; d < DyeField::coords; ++d) {
+        resampleConcentration(density[d], dim, oldDensity[d], oldDim);
+        setBoundaries<Continuity>(density[d], boundaries);
+    }
+    for (std::size_t d = 0; d < VelocityField::coords; ++d) {
+        resampleVelocity(velocity[d], velocityDim, oldVelocity[d], oldVelocityDim, d);
+    }
+    // Interpolation leaves some divergence, which the projection removes
+    project(velocity);
+
+    heldSteps = 0;
+    heldTime = 0;
+    velocityAtRest = false;
+    requestVelocityUpdate();
+}
+
+Location FluidSystem::velocitySpacing() const {
+    const Location scale = {static_cast<Scalar>(velocityScale),
+                            static_cast<Scalar>(velocityScale), 1};
+    return spacing * scale;
+}
+
+FluidSystem::Diffusion FluidSystem::diffusionScheme(Scalar coefficient, Scalar dt,
+                                                    const Location &spacing) const {
+    const Location numbers = coefficient * dt / spacing.square();
+    if (coefficient * dt == 0) return {kDiffusionNone, Location::Zero(), 0};
+    const unsigned int sweeps = std::max<Scalar>(1, std::ceil(numbers.mean() /
+                                                              maxExplicitNumber));
+    if (sweeps <= maxExplicitSweeps && sweeps < solverIterations) {
+        return {kDiffusionExplicit, numbers, sweeps};
+    }
+    return {kDiffusionImplicit, numbers, solverIterations};
+}
+
+bool FluidSystem::atRest() const {
+    return velocityAtRest;
+}
+
+void FluidSystem::checkRest(const VelocityField &addedVelocity) {
+    if (exchangeHalos || activity.maxSpeed > restThreshold ||
+        activity.maxDivergence > restThreshold) {
+        return;
+    }
+    // Only checked once the flow is still, so the sources are rarely scanned
+    if (maxSpeed(addedVelocity, staggeredDim) > 0) return;
+    velocity.clear();
+    velocityAtRest = true;
+}
+
+void FluidSystem::adaptVelocityInterval() {
+    const Scalar peakSpeed = maxSpeed(velocity, staggeredDim);
+    const Scalar scale = std::max(peakSpeed, lastPeakSpeed);
+    if (scale == 0 || std::abs(peakSpeed - lastPeakSpeed) <= velocityTolerance * scale) {
+        velocityInterval = std::min(maxVelocityInterval, 2 * velocityInterval);
+    } else {
+        velocityInterval = std::max(1, velocityInterval / 2);
+    }
+    lastPeakSpeed = peakSpeed;
+}
+
+Boundaries FluidSystem::densityBoundaries() const {
+    return {dim, exchangeHalos ? &exchangeHalos : nullptr};
+}
+Boundaries FluidSystem::velocityBoundaries() const {
+    return {velocityDim, exchangeHalos ? &exchangeHalos : nullptr};
+}
+Boundaries FluidSystem::pressureBoundaries() const {
+    return {velocityDim, exchangeHalos ? &exchangeHalos : nullptr};
+}
+std::array<FluidSystem::FieldKernels, VelocityField::coords>
+FluidSystem::velocityKernels() const {
+    return {{wallKernels<0>(horizontalNeumann), wallKernels<1>(verticalNeumann),
+             fieldKernels<3, Neumann<2> >()}};
+}
+
+// Stepping diffuses the current fields into the previous fields, and then advects the
+// previous fields back into the current fields.
+
+void FluidSystem::markPhase(Phase phase) {
+#pragma omp master
+    {
+        const double now = omp_get_wtime();
+        phaseTimes[phase] += (now - phaseStart) * 1000;
+        phaseStart = now;
+    }
+}
+
+std::function<void()> FluidSystem::timedTask(Phase phase, std::function<void()> work) {
+    return [this, phase, work] {
+        const double start = omp_get_wtime();
+        work();
+#pragma omp master
+        {
+            const double share = static_cast<double>(omp_get_num_threads()) /
+                                 omp_get_team_size(omp_get_level() - 1);
+            const double time = (omp_get_wtime() - start) * 1000 * share;
+#pragma omp atomic
+            phaseTimes[phase] += time;
+        }
+    };
+}
+
+bool FluidSystem::diffusionAddsSources(const Diffusion &diffusion) const {
+    return fusedStages && !exchangeHalos && diffusion.scheme != kDiffusionNone;
 }
 
 void FluidSystem::stepDensity(Scalar dt, const DyeField &addedDensity) {
-    density += addedDensity * dt;
-    std::array<BoundarySetter, density.coords> boundarySetters;
-    for (std::size_t i = 0; i < density.coords; ++i) {
-        boundarySetters[i] = std::bind(&setContinuityBoundaries, std::placeholders::_1, dim);
+#pragma omp master
+    phaseStart = omp_get_wtime();
+    // Sparse sources take less than the pass which starts diffusion would to add them
+    const SourceSpans *spans = sourceSpans(addedDensity);
+    const bool addWhileDiffusing = !spans && diffusionAddsSources(densityDiffusion);
+    if (!addWhileDiffusing) addSources(density, addedDensity, dt, spans);
+    markPhase(kPhaseSources);
+    const Boundaries boundaries = densityBoundaries();
+    if (velocityAtRest && diffusionConstant == 0) {
+        // Nothing moves or spreads the dye
+        for (std::size_t d = 0; d < DyeField::coords; ++d) {
+            setBoundaries<Continuity>(density[d], boundaries);
+        }
+        return;
     }
 
-    std::swap(density, densityPrev);
-    diffuse(density, densityPrev, diffusionConstant, dt, dim, boundarySetters);
-    std::swap(density, densityPrev);
-    advect(density, densityPrev, velocity, dt, dim, boundarySetters);
+    if (densityDiffusion.scheme == kDiffusionNone) {
+        // Advect from the current field as it is, instead of copying it over
+#pragma omp single
+        std::swap(density, densityPrev);
+        for (std::size_t d = 0; d < DyeField::coords; ++d) {
+            setBoundaries<Continuity>(densityPrev[d], boundaries);
+        }
+    } else {
+        for (std::size_t d = 0; d < DyeField::coords; ++d) {
+            const Addition addition = {addedDensity[d], dt};
+            diffuse<Continuity>(densityPrev[d], density[d], densityWorkspace[d],
+                                densityDiffusion, dim, boundaries,
+                                addWhileDiffusing ? &addition : nullptr);
+        }
+    }
+    markPhase(kPhaseDiffusion);
+    for (std::size_t d = 0; d < DyeField::coords; ++d) {
+        if (velocityAtRest) {
+            // Backtraces through a zero velocity land where they start
+            parallelAssign(density[d], densityPrev[d], AssignOp());
+            setBoundaries<Continuity>(density[d], boundaries);
+        } else {
+            advect<0, Continuity>(density[d], densityPrev[d], densityCompensation[d], velocity,
+                                  dt, dim, boundaries);
+        }
+    }
+    markPhase(kPhaseAdvection);
 }
 
 void FluidSystem::stepVelocity(Scalar dt, const VelocityField &addedVelocity) {
-    velocity += addedVelocity * dt;
-    std::array<BoundarySetter, velocity.coords> boundarySetters;
-    if (horizontalNeumann) {
-        boundarySetters[0] = std::bind(&setHorizontalNeumannBoundaries, std::placeholders::_1, dim);
+#pragma omp master
+    phaseStart = omp_get_wtime();
+    const SourceSpans *spans = sourceSpans(addedVelocity);
+    const bool addWhileDiffusing = !spans && diffusionAddsSources(velocityDiffusion);
+    if (!addWhileDiffusing) addSources(velocity, addedVelocity, dt, spans);
+    markPhase(kPhaseSources);
+    const Boundaries boundaries = velocityBoundaries();
+    const std::array<FieldKernels, VelocityField::coords> kernels = velocityKernels();
+
+    if (velocityDiffusion.scheme == kDiffusionNone) {
+#pragma omp single
+        std::swap(velocity, velocityPrev);
+        for (std::size_t d = 0; d < VelocityField::coords; ++d) {
+            kernels[d].setBoundaries(velocityPrev[d], boundaries);
+        }
     } else {
-        boundarySetters[0] = std::bind(&setContinuityBoundaries, std::placeholders::_1, dim);
+        for (std::size_t d = 0; d < VelocityField::coords; ++d) {
+            const Addition addition = {addedVelocity[d], dt};
+            (this->*kernels[d].diffuse)(velocityPrev[d], velocity[d], velocityWorkspace[d],
+                                        velocityDiffusion, staggeredDim, boundaries,
+                                        addWhileDiffusing ? &addition : nullptr);
+        }
     }
-    if (verticalNeumann) {
-        boundarySetters[1] = std::bind(&setVerticalNeumannBoundaries, std::placeholders::_1, dim);
-    } else {
-        boundarySetters[1] = std::bind(&setContinuityBoundaries, std::placeholders::_1, dim);
+    markPhase(kPhaseDiffusion);
+    project(velocityPrev);
+    markPhase(kPhaseProjection);
+
+    for (std::size_t d = 0; d < VelocityField::coords; ++d) {
+        (this->*kernels[d].advect)(velocity[d], velocityPrev[d], velocityCompensation[d],
+                                   velocityPrev, dt, staggeredDim, boundaries);
     }
-    boundarySetters[2] = std::bind(&setDepthNeumannBoundaries, std::placeholders::_1, dim);
+    markPhase(kPhaseAdvection);
+    project(velocity, &activity);
+    markPhase(kPhaseProjection);
+}
 
-    std::swap(velocity, velocityPrev);
-    diffuse(velocity, velocityPrev, viscosity, dt, staggeredDim, boundarySetters);
-    project(velocity);
+void FluidSystem::stepTaskGraph(Scalar dt, Scalar velocityDt, const DyeField &addedDensity,
+                                const VelocityField &addedVelocity) {
+    const Boundaries densityBoundaries = this->densityBoundaries();
+    const Boundaries velocityBoundaries = this->velocityBoundaries();
+    const std::array<FieldKernels, VelocityField::coords> velocityKernels =
+        this->velocityKernels();
 
-    std::swap(velocity, velocityPrev);
-    advect(velocity, velocityPrev, velocityPrev, dt, staggeredDim, boundarySetters);
-    project(velocity);
+    TaskGraph graph;
+    // Dye advection waits for the velocity update, if there is one
+    std::vector<TaskGraph::Task> velocityUpdate;
+    if (velocityDt) {
+        const SourceSpans *spans = sourceSpans(addedVelocity);
+        const bool addWhileDiffusing = !spans && diffusionAddsSources(velocityDiffusion);
+        std::vector<TaskGraph::Task> velocityDiffusions;
+        for (std::size_t d = 0; d < VelocityField::coords; ++d) {
+            std::vector<TaskGraph::Task> sources;
+            if (spans) {
+                sources.push_back(graph.add(timedTask(kPhaseSources, [=, &addedVelocity] {
+                    spans->add(velocity[d], addedVelocity[d], velocityDt);
+                })));
+            } else if (!addWhileDiffusing) {
+                sources.push_back(graph.add(timedTask(kPhaseSources, [=, &addedVelocity] {
+                    parallelAssign(velocity[d], addedVelocity[d] * velocityDt, AddAssignOp());
+                })));
+            }
+            velocityDiffusions.push_back(graph.add(timedTask(kPhaseDiffusion, [=, &addedVelocity] {
+                const Addition addition = {addedVelocity[d], velocityDt};
+                (this->*velocityKernels[d].diffuse)(velocityPrev[d], velocity[d],
+                                                    velocityWorkspace[d], velocityDiffusion,
+                                                    staggeredDim, velocityBoundaries,
+                                                    addWhileDiffusing ? &addition : nullptr);
+            }), sources));
+        }
+        // The projections hold up every later stage, so they get a team of their own
+        TaskGraph::Task diffusionProjection = graph.add(timedTask(kPhaseProjection, [=] {
+            project(velocityPrev);
+        }), velocityDiffusions, true);
+        std::vector<TaskGraph::Task> velocityAdvections;
+        for (std::size_t d = 0; d < VelocityField::coords; ++d) {
+            velocityAdvections.push_back(graph.add(timedTask(kPhaseAdvection, [=] {
+                (this->*velocityKernels[d].advect)(velocity[d], velocityPrev[d],
+                                                   velocityCompensation[d], velocityPrev,
+                                                   velocityDt, staggeredDim,
+                                                   velocityBoundaries);
+            }), {diffusionProjection}));
+        }
+        velocityUpdate.push_back(graph.add(timedTask(kPhaseProjection, [=] {
+            project(velocity, &activity);
+        }), velocityAdvections, true));
+    }
+
+    // Dye diffusion does not depend on the velocity, so it overlaps the velocity update
+    const SourceSpans *spans = sourceSpans(addedDensity);
+    const bool addWhileDiffusing = !spans && diffusionAddsSources(densityDiffusion);
+    for (std::size_t d = 0; d < DyeField::coords; ++d) {
+        std::vector<TaskGraph::Task> sources;
+        if (spans) {
+            sources.push_back(graph.add(timedTask(kPhaseSources, [=, &addedDensity] {
+                spans->add(density[d], addedDensity[d], dt);
+            })));
+        } else if (!addWhileDiffusing) {
+            sources.push_back(graph.add(timedTask(kPhaseSources, [=, &addedDensity] {
+                parallelAssign(density[d], addedDensity[d] * dt, AddAssignOp());
+            })));
+        }
+        std::vector<TaskGraph::Task> dependencies = velocityUpdate;
+        dependencies.push_back(graph.add(timedTask(kPhaseDiffusion, [=, &addedDensity] {
+            const Addition addition = {addedDensity[d], dt};
+            diffuse<Continuity>(densityPrev[d], density[d], densityWorkspace[d],
+                                densityDiffusion, dim, densityBoundaries,
+                                addWhileDiffusing ? &addition : nullptr);
+        }), sources));
+        graph.add(timedTask(kPhaseAdvection, [=] {
+            if (velocityAtRest) {
+                parallelAssign(density[d], densityPrev[d], AssignOp());
+                setBoundaries<Continuity>(density[d], densityBoundaries);
+            } else {
+                advect<0, Continuity>(density[d], densityPrev[d], densityCompensation[d],
+                                      velocity, dt, dim, densityBoundaries);
+            }
+        }), dependencies);
+    }
+
+    NestedParallelism nesting;
+#pragma omp parallel if(dim.prod() >= parallelThreshold)
+    graph.run();
 }
 
-void FluidSystem::project(VelocityField &velocity) const {
-    Grid pressure(fullDim);
-    Grid divergence(fullDim);
-    div(divergence, velocity, dim);
-    divergence = -1 * divergence;
-    setContinuityBoundaries(divergence, dim);
-    setContinuityBoundaries(pressure, dim);
-    linearSolve(pressure, divergence, 1, 6, dim, std::bind(&setContinuityBoundaries,
-                                                           std::placeholders::_1, dim));
-    VelocityField gradient(fullStaggeredDim);
-    gradient.clear();
-    grad(gradient, pressure, dim);
-    velocity -= gradient;
-    if (horizontalNeumann) {
-        setHorizontalNeumannBoundaries(velocity[0], dim);
+template<typename Policy>
+void FluidSystem::diffuse(Grid &out, Grid &in, Grid &workspace, const Diffusion &diffusion,
+                          const Indices &dim, const Boundaries &boundaries,
+                          const Addition *addition) const {
+    const Location &a = diffusion.numbers;
+    switch (diffusion.scheme) {
+    case kDiffusionNone:
+        if (addition) parallelAssign(in, addition->grid * addition->scale, AddAssignOp());
+        parallelAssign(out, in, AssignOp());
+        setBoundaries<Policy>(out, boundaries);
+        break;
+    case kDiffusionExplicit:
+        explicitDiffusion<Policy>(out, in, workspace, a, dim, boundaries, diffusion.sweeps,
+                                  addition);
+        break;
+    case kDiffusionImplicit:
+        linearSolve<Policy>(out, in, workspace, a, 1 + 2 * a.sum(), dim, boundaries,
+                            diffusion.sweeps, addition);
+        break;
+    }
+}
+
+void FluidSystem::project(VelocityField &velocity, FlowActivity *activity) {
+    const Location h = velocitySpacing();
+    const Boundaries pressureBoundaries = this->pressureBoundaries();
+    if (fusedStages) {
+        negatedDiv(divergence, velocity, h, pressureBoundaries, activity);
     } else {
-        setContinuityBoundaries(velocity[0], dim);
+        div(divergence, velocity, velocityDim, h, activity);
+        parallelAssign(divergence, -1 * divergence, AssignOp());
+        setBoundaries<Continuity>(divergence, pressureBoundaries);
+    }
+    const Location weights = 1 / h.square();
+    linearSolve<Continuity>(pressure, divergence, pressureWorkspace, weights, 2 * weights.sum(),
+                            velocityDim, pressureBoundaries, solverIterations);
+    const Boundaries boundaries = velocityBoundaries();
+    const std::array<FieldKernels, VelocityField::coords> kernels = velocityKernels();
+    if (fusedStages) {
+        for (std::size_t d = 0; d < VelocityField::coords; ++d) {
+            kernels[d].subtractGradient(velocity[d], pressure, d, h, boundaries);
+        }
+        return;
     }
-    if (verticalNeumann) {
-        setVerticalNeumannBoundaries(velocity[1], dim);
+    // Only the interior of the gradient is written, so its ghost cells stay zero
+    grad(gradient, pressure, velocityDim, h);
+    velocity -= gradient;
+    for (std::size_t d = 0; d < VelocityField::coords; ++d) {
+        kernels[d].setBoundaries(velocity[d], boundaries);
+    }
+}
+
+void FluidSystem::upsampledBacktrace(Grid &out, const Grid &in, const VelocityField &velocity,
+                                     const Location &peak, Scalar dt,
+                                     const Boundaries &boundaries) const {
+    const Band band = interiorBand(dim, std::abs(dt) * peak / spacing);
+    const Location upper = dim.cast<Scalar>() + 0.5f;
+    sweepRows<Continuity>(out, dim(1), boundaries, [&](Grid::Index j) {
+        for (Grid::Index k = 1; k <= dim(2); ++k) {
+            Grid::Index begin, end;
+            band.row(j, k, begin, end);
+            for (Grid::Index i = 1; i < begin; ++i) {
+                out(i, j, k) = upsampledBacktraceCell<true>(in, velocity, upper, dt, i, j, k);
+            }
+            for (Grid::Index i = begin; i <= end; ++i) {
+                out(i, j, k) = upsampledBacktraceCell<false>(in, velocity, upper, dt, i, j, k);
+            }
+            for (Grid::Index i = std::max(begin, end + 1); i <= dim(0); ++i) {
+                out(i, j, k) = upsampledBacktraceCell<true>(in, velocity, upper, dt, i, j, k);
+            }
+        }
+    });
+}
+template<bool clamped>
+Scalar FluidSystem::upsampledBacktraceCell(const Grid &in, const VelocityField &velocity,
+                                           const Location &upper, Scalar dt, Grid::Index i,
+                                           Grid::Index j, Grid::Index k) const {
+    // Backtrack to the midpoint of RK2, as in Backtracer::trace
+    Location x = {
+      static_cast<Scalar>(i), static_cast<Scalar>(j),
+      static_cast<Scalar>(k)
+    };
+    Location xMidpoint = x - 0.5 * dt * upsampledVelocity(velocity, x);
+    if (clamped) xMidpoint = xMidpoint.min(upper).max(0.5);
+    x = x - dt * upsampledVelocity(velocity, xMidpoint);
+    if (clamped) x = x.min(upper).max(0.5);
+    return interpolate(in, x);
+}
+Location FluidSystem::upsampledVelocity(const VelocityField &velocity, const Location &x) const {
+    // The center of velocity cell I covers dye cells s * (I - 1) + 1 to s * I
+    const Scalar s = velocityScale;
+    const Location xVelocity = {(x[0] + (s - 1) / 2) / s, (x[1] + (s - 1) / 2) / s, x[2]};
+    const Location v = {interpolate(velocity[0], xVelocity), interpolate(velocity[1], xVelocity),
+                        interpolate(velocity[2], xVelocity)};
+    return v / spacing;
+}
+
+void FluidSystem::Band::row(Grid::Index j, Grid::Index k, Grid::Index &begin,
+                            Grid::Index &end) const {
+    if (j >= this->begin(1) && j <= this->end(1) && k >= this->begin(2) && k <= this->end(2)) {
+        begin = this->begin(0);
+        end = this->end(0);
     } else {
-        setContinuityBoundaries(velocity[1], dim);
+        begin = 1;
+        end = 0;
     }
-    setDepthNeumannBoundaries(velocity[2], dim);
+}
+FluidSystem::Band FluidSystem::interiorBand(const Indices &dim, const Location &reach) {
+    // Velocities interpolate those of the grid, so no backtrace or midpoint moves further
+    // than reach; a little more is allowed for rounding
+    const Location margin = 1.001f * reach + 0.001f;
+    Band band;
+    for (Location::Index l = 0; l < kGridDimensions; ++l) {
+        if (margin(l) < dim(l)) {
+            band.begin(l) = std::ceil(0.5f + margin(l));
+            band.end(l) = std::floor(dim(l) + 0.5f - margin(l));
+        } else { // including a reach which is not finite
+            band.begin(l) = 1;
+            band.end(l) = 0;
+        }
+    }
+    return band;
 }
 
-void grad(VelocityField &out, const Grid &in, const Indices &dim) {
-    for (Grid::Index i = 1; i <= dim(0); ++i) {
+void grad(VelocityField &out, const Grid &in, const Indices &dim, const Location &spacing) {
+    if (omp_get_level() == 0) {
+#pragma omp parallel
+        grad(out, in, dim, spacing);
+        return;
+    }
+    const Location weights = 0.5 / spacing;
+    const Scalar wx = weights(0), wy = weights(1), wz = weights(2);
+#pragma omp for collapse(2) schedule(static)
+    for (Grid::Index k = 1; k <= dim(2); ++k) {
         for (Grid::Index j = 1; j <= dim(1); ++j) {
-            for (Grid::Index k = 1; k <= dim(2); ++k) {
-                out[0](i, j, k) = 0.5 * (in(i + 1, j, k) - in(i - 1, j, k));
-                out[1](i, j, k) = 0.5 * (in(i, j + 1, k) - in(i, j - 1, k));
-                out[2](i, j, k) = 0.5 * (in(i, j, k + 1) - in(i, j, k - 1));
+            for (Grid::Index i = 1; i <= dim(0); ++i) {
+                out[0](i, j, k) = wx * (in(i + 1, j, k) - in(i - 1, j, k));
+                out[1](i, j, k) = wy * (in(i, j + 1, k) - in(i, j - 1, k));
+                out[2](i, j, k) = wz * (in(i, j, k + 1) - in(i, j, k - 1));
             }
         }
     }
 }
-void div(Grid &out, const VelocityField &in, const Indices &dim) {
-    for (Grid::Index i = 1; i <= dim(0); ++i) {
+void div(Grid &out, const VelocityField &in, const Indices &dim, const Location &spacing,
+         FlowActivity *activity) {
+    if (omp_get_level() == 0) {
+#pragma omp parallel
+        div(out, in, dim, spacing, activity);
+        return;
+    }
+    const Location weights = 0.5 / spacing;
+    const Scalar wx = weights(0), wy = weights(1), wz = weights(2);
+    const Scalar sx = 2 * wx, sy = 2 * wy, sz = 2 * wz;
+    if (activity) {
+#pragma omp single
+        *activity = FlowActivity();
+    }
+    // Each thread's share of the activity, folded into the divergence pass
+    Scalar speed = 0, divergence = 0;
+#pragma omp for collapse(2) schedule(static)
+    for (Grid::Index k = 1; k <= dim(2); ++k) {
         for (Grid::Index j = 1; j <= dim(1); ++j) {
-            for (Grid::Index k = 1; k <= dim(2); ++k) {
+            for (Grid::Index i = 1; i <= dim(0); ++i) {
                 out(i, j, k) = 0;
-                out(i, j, k) += 0.5 * (in[0](i + 1, j, k) - in[0](i - 1, j, k));
-                out(i, j, k) += 0.5 * (in[1](i, j + 1, k) - in[1](i, j - 1, k));
-                out(i, j, k) += 0.5 * (in[2](i, j, k + 1) - in[2](i, j, k - 1));
+                out(i, j, k) += wx * (in[0](i + 1, j, k) - in[0](i - 1, j, k));
+                out(i, j, k) += wy * (in[1](i, j + 1, k) - in[1](i, j - 1, k));
+                out(i, j, k) += wz * (in[2](i, j, k + 1) - in[2](i, j, k - 1));
+                if (activity) {
+                    speed = std::max(speed, std::max(sx * std::abs(in[0](i, j, k)),
+                                                     std::max(sy * std::abs(in[1](i, j, k)),
+                                                              sz * std::abs(in[2](i, j, k)))));
+                    divergence = std::max(divergence, std::abs(out(i, j, k)));
+                }
+            }
+        }
+    }
+    if (activity) {
+#pragma omp critical
+        {
+            activity->maxSpeed = std::max(activity->maxSpeed, speed);
+            activity->maxDivergence = std::max(activity->maxDivergence, divergence);
+        }
+#pragma omp barrier
+    }
+}
+void negatedDiv(Grid &out, const VelocityField &in, const Location &spacing,
+                const Boundaries &boundaries, FlowActivity *activity) {
+    if (omp_get_level() == 0) {
+#pragma omp parallel
+        negatedDiv(out, in, spacing, boundaries, activity);
+        return;
+    }
+    const Indices &dim = boundaries.dim;
+    const Location weights = 0.5 / spacing;
+    const Scalar wx = weights(0), wy = weights(1), wz = weights(2);
+    const Scalar sx = 2 * wx, sy = 2 * wy, sz = 2 * wz;
+    if (activity) {
+#pragma omp single
+        *activity = FlowActivity();
+    }
+    // As in div, summing the same terms in the same order
+    Scalar speed = 0, divergence = 0;
+    sweepRows<Continuity>(out, dim(1), boundaries, [&](Grid::Index j) {
+        for (Grid::Index k = 1; k <= dim(2); ++k) {
+            for (Grid::Index i = 1; i <= dim(0); ++i) {
+                Scalar sum = 0;
+                sum += wx * (in[0](i + 1, j, k) - in[0](i - 1, j, k));
+                sum += wy * (in[1](i, j + 1, k) - in[1](i, j - 1, k));
+                sum += wz * (in[2](i, j, k + 1) - in[2](i, j, k - 1));
+                out(i, j, k) = -sum;
+                if (activity) {
+                    speed = std::max(speed, std::max(sx * std::abs(in[0](i, j, k)),
+                                                     std::max(sy * std::abs(in[1](i, j, k)),
+                                                              sz * std::abs(in[2](i, j, k)))));
+                    divergence = std::max(divergence, std::abs(sum));
+                }
+            }
+        }
+    });
+    finishBoundaries(out, boundaries);
+    if (activity) {
+#pragma omp critical
+        {
+            activity->maxSpeed = std::max(activity->maxSpeed, speed);
+            activity->maxDivergence = std::max(activity->maxDivergence, divergence);
+        }
+#pragma omp barrier
+    }
+}
+Scalar maxSpeed(const VelocityField &velocity, const Indices &staggeredDim) {
+    const Indices &dim = staggeredDim;
+    Scalar result = 0;
+#pragma omp parallel for collapse(2) schedule(static) reduction(max:result)
+    for (Grid::Index k = 1; k <= dim(2); ++k) {
+        for (Grid::Index j = 1; j <= dim(1); ++j) {
+            for (Grid::Index i = 1; i <= dim(0); ++i) {
+                result = std::max(result, std::max(std::abs(velocity[0](i, j, k)),
+                                                   std::max(std::abs(velocity[1](i, j, k)),
+                                                            std::abs(velocity[2](i, j, k)))));
+            }
+        }
+    }
+    return result;
+}
+Location peakVelocity(const VelocityField &velocity) {
+    Location peak;
+#pragma omp single copyprivate(peak)
+    for (std::size_t d = 0; d < VelocityField::coords; ++d) {
+        const Eigen::Tensor<Scalar, 0> max = velocity[d].abs().maximum();
+        peak(d) = max();
+    }
+    return peak;
+}
+void resampleConcentration(Grid &out, const Indices &outDim, const Grid &in,
+                           const Indices &inDim) {
+    const std::vector<Overlap> x = overlaps(inDim(0), outDim(0));
+    const std::vector<Overlap> y = overlaps(inDim(1), outDim(1));
+    const std::vector<Overlap> z = overlaps(inDim(2), outDim(2));
+#pragma omp parallel for collapse(2) schedule(static)
+    for (Grid::Index k = 1; k <= outDim(2); ++k) {
+        for (Grid::Index j = 1; j <= outDim(1); ++j) {
+            const Overlap &zOverlap = z[k - 1], &yOverlap = y[j - 1];
+            for (Grid::Index i = 1; i <= outDim(0); ++i) {
+                const Overlap &xOverlap = x[i - 1];
+                Scalar sum = 0;
+                for (std::size_t c = 0; c < zOverlap.fractions.size(); ++c) {
+                    for (std::size_t b = 0; b < yOverlap.fractions.size(); ++b) {
+                        const Scalar weight = zOverlap.fractions[c] * yOverlap.fractions[b];
+                        for (std::size_t a = 0; a < xOverlap.fractions.size(); ++a) {
+                            sum += weight * xOverlap.fractions[a] *
+                                   in(xOverlap.first + a, yOverlap.first + b,
+                                      zOverlap.first + c);
+                        }
+                    }
+                }
+                out(i, j, k) = sum;
+            }
+        }
+    }
+}
+void resampleVelocity(Grid &out, const Indices &outDim, const Grid &in, const Indices &inDim,
+                      Grid::Index axis) {
+    const Location ratio = inDim.cast<Scalar>() / outDim.cast<Scalar>();
+    // Components lie on the faces of their cells along their axis, and at the centers of
+    // the cells along the others
+    Location offset = Location::Constant(0.5);
+    offset(axis) = 1;
+    const Location maxPosition = (inDim + 1).cast<Scalar>();
+#pragma omp parallel for collapse(2) schedule(static)
+    for (Grid::Index k = 1; k <= outDim(2) + 1; ++k) {
+        for (Grid::Index j = 1; j <= outDim(1) + 1; ++j) {
+            for (Grid::Index i = 1; i <= outDim(0) + 1; ++i) {
+                const Location cell = {static_cast<Scalar>(i), static_cast<Scalar>(j),
+                                       static_cast<Scalar>(k)};
+                const Location x = ((cell - offset) * ratio + offset).min(maxPosition).max(0);
+                out(i, j, k) = interpolate(in, x);
             }
         }
     }
@@ -1,7 +1,10 @@
 #ifndef FLUIDSYSTEM_H
 #define FLUIDSYSTEM_H
 
+#include <array>
+#include <cmath>
 #include <functional>
+#include <vector>
 
 #include "vectorfield.h"
 
@@ -11,15 +14,65 @@
 typedef VectorField<0, 3> DyeField;
 typedef VectorField<3, 3> VelocityField;
 
+// Peak speed of a velocity field over its interior in cells per unit time, and its peak
+// divergence per unit time
+struct FlowActivity {
+    Scalar maxSpeed = 0;
+    Scalar maxDivergence = 0;
+};
+
+// The cells where a source field may be nonzero, as the span of cells along x which they
+// cover in each (j, k) row of its grids, ghost cells included. A span covers all the cells
+// of its row in the boxes included, so adding the field over the spans alone adds all of
+// it, and each cell once.
+class SourceSpans
+{
+public:
+    SourceSpans(const TensorIndices &dimensions);
+
+    // Includes the cells from begin to end (inclusive) along each axis, clipped to the grids
+    void include(const Indices &begin, const Indices &end);
+    // Includes the nonzero cells of a grid
+    void include(const Grid &grid);
+    void clear();
+    // Clears the spans for grids of other dimensions
+    void reset(const TensorIndices &dimensions);
+
+    // out += source * scale over the spans, as a kernel
+    void add(Grid &out, const Grid &source, Scalar scale) const;
+
+private:
+    struct Span {
+        Grid::Index begin, end;
+    };
+    TensorIndices dimensions;
+    // Of every row, empty while begin > end
+    std::vector<Span> spans;
+    // Rows with nonempty spans
+    std::vector<Grid::Index> rows;
+};
+
 class FluidSystem
 {
 public:
+    // The velocity may be held on a grid coarser than the dye by velocityScale in x and y,
+    // which must divide width and height
     FluidSystem(Grid::Index width = 40, Grid::Index height = 40, Grid::Index depth = 5,
-                Scalar diffusionConstant = 0, Scalar viscosity = 0);
+                Scalar diffusionConstant = 0, Scalar viscosity = 0,
+                Grid::Index velocityScale = 1);
+
+    const Grid::Index velocityScale;
+    // Grid dimensions: dim is that of the dye, velocityDim that of the (cell-centered)
+    // pressure, and staggeredDim that of the velocity components. Only resample() may
+    // change them.
+    Indices dim, velocityDim, staggeredDim;
+    TensorIndices fullDim, fullVelocityDim, fullStaggeredDim;
 
-    // Grid dimensions
-    const Indices dim, staggeredDim;
-    const TensorIndices fullDim, fullStaggeredDim;
+    // Size of a dye cell along each axis, in the length unit of the velocity and of the
+    // diffusion coefficients; velocity cells are velocityScale times as wide in x and y.
+    // Shallow liquids can be covered by a few thick cells in z.
+    Location spacing = Location::Ones();
+    Location velocitySpacing() const;
 
     Scalar diffusionConstant;
     Scalar viscosity;
@@ -27,40 +80,301 @@ public:
     DyeField density;
     VelocityField velocity;
 
+    // Whether the x and y components of the velocity have Neumann boundary conditions on
+    // the faces normal to them, or continuity ones; the z component always has Neumann ones
     bool horizontalNeumann = true;
     bool verticalNeumann = true;
+    // Sides of the x and y axes, first and last, which have continuity conditions even so,
+    // e.g. where a system covering part of another meets the other's interior
+    std::array<std::array<bool, 2>, 2> openSides = {{{{false, false}}, {{false, false}}}};
+
+    // Grids with fewer cells than this are stepped on one thread, since fork/join and
+    // barrier costs would outweigh the work shared among threads
+    Grid::Index parallelThreshold = 16 * 16 * 4;
+
+    enum Schedule {
+        // Stages run one after another, each split across all threads
+        kScheduleDataParallel,
+        // Independent stages (e.g. per-channel diffusion, or dye diffusion alongside
+        // the velocity update) run concurrently as tasks, each on one thread except for
+        // the projections, which are split across a nested team
+        kScheduleTaskGraph
+    };
+    Schedule schedule = kScheduleDataParallel;
+
+    // Whether stages which pass over the same grids are merged into single passes: the
+    // dense sources are added in the copy which starts their diffusion, and the projection
+    // negates the divergence and sets the boundaries of it and of the velocity in the
+    // sweeps which compute them. Results are the same either way, so this is mostly for
+    // measuring the merged passes. Sources are kept apart while halos are exchanged.
+    bool fusedStages = true;
+
+    // Jacobi iterations of each diffusion and pressure solve
+    unsigned int solverIterations = 20;
+
+    enum DiffusionScheme {
+        // The coefficient is zero, so the field is passed on as it is
+        kDiffusionNone,
+        // Forward Euler sweeps, each within maxExplicitNumber
+        kDiffusionExplicit,
+        // Jacobi iterations of backward Euler, which is stable for any timestep
+        kDiffusionImplicit
+    };
+    struct Diffusion {
+        DiffusionScheme scheme;
+        // Diffusion number along each axis, i.e. coefficient * dt over the squared spacing
+        Location numbers;
+        // Explicit sweeps or Jacobi iterations
+        unsigned int sweeps;
+    };
+    // Largest mean of the diffusion numbers of an explicit sweep; forward Euler is stable
+    // up to 1/6, and keeps some weight on each cell's own value below that
+    Scalar maxExplicitNumber = 0.125;
+    // Diffusion which would take more explicit sweeps than this is solved implicitly
+    unsigned int maxExplicitSweeps = 4;
+    // Cheapest stable scheme for a coefficient and timestep on cells of some spacing
+    Diffusion diffusionScheme(Scalar coefficient, Scalar dt, const Location &spacing) const;
+    // How the last step diffused dye, and the last velocity update diffused velocity
+    Diffusion densityDiffusion, velocityDiffusion;
+
+    enum Advection {
+        // One RK2 backtrace per field
+        kAdvectionSemiLagrangian,
+        // Backtraces forwards and back to estimate the error of the semi-Lagrangian
+        // step, and advects the field corrected by half of it (BFECC); about three
+        // times the cost, but much less numerical diffusion
+        kAdvectionMacCormack
+    };
+    Advection advection = kAdvectionSemiLagrangian;
+
+    // Steps between velocity updates. In between, dye is advected by the velocity held
+    // from the last update, and the next update advances the velocity by all the time
+    // since. Subdomains of a split system must all keep the same interval.
+    int velocityInterval = 1;
+    // If set, the interval doubles up to maxVelocityInterval after each update which
+    // changes the peak speed by less than velocityTolerance (relative), and halves after
+    // any other update
+    bool adaptiveVelocityInterval = false;
+    int maxVelocityInterval = 8;
+    Scalar velocityTolerance = 0.05;
+
+    // Once an update leaves the velocity's activity at or below restThreshold with no
+    // velocity source, the flow is at rest: the velocity is zeroed and no longer updated,
+    // and dye is only diffused, until the sources change or requestVelocityUpdate() is
+    // called. A system with halo exchange never rests, since its subdomains must step
+    // in lockstep.
+    Scalar restThreshold = 0;
+    // Activity of the velocity as of its last update, before the final projection
+    FlowActivity activity;
+    bool atRest() const;
+
+    enum Phase {
+        kPhaseSources,
+        kPhaseDiffusion,
+        kPhaseProjection,
+        kPhaseAdvection,
+        kNumPhases
+    };
+    // Wall time in ms spent in each phase, accumulated over steps until reset by the
+    // caller. The task graph overlaps phases, so it charges each task's time to its phase
+    // in proportion to the threads the task occupied, which estimates the phase's share of
+    // the step's wall time.
+    std::array<double, kNumPhases> phaseTimes;
+
+    // If set, called on a field right after its boundary conditions have been set, and
+    // after any other update which leaves its ghost cells stale. A subdomain of a
+    // distributed system uses this to fill the ghost layers it shares with its
+    // neighbours. It is called as a kernel, so it needs kScheduleDataParallel.
+    BoundarySetter exchangeHalos;
 
     void step(const DyeField &addedDensity, const VelocityField &addedVelocity,
               Scalar dt);
+    // Declares that a source field is zero outside of spans, so that step() only adds it
+    // over them, instead of over the whole grids. The spans must be kept up to date with
+    // the field for as long as it is declared; a null one withdraws the declaration.
+    // Other sources are added everywhere.
+    void setSourceSpans(const DyeField &source, const SourceSpans *spans);
+    void setSourceSpans(const VelocityField &source, const SourceSpans *spans);
 
     void clear();
+    // Rebuilds the grids at new dimensions over the same extent, scaling the spacing to
+    // match. The dye is carried over conservatively, and the velocity is interpolated and
+    // projected. The velocity scale must divide the new width and height. Sources must be
+    // resampled to match, e.g. by FluidManipulator::resample(). Not for subdomains of a
+    // split system, and not a kernel, so it must be called outside of parallel regions.
+    void resample(Grid::Index width, Grid::Index height, Grid::Index depth);
+    // Makes the next step update the velocity, e.g. after its sources or boundary
+    // conditions have changed; stepping with a different velocity source also does
+    void requestVelocityUpdate();
 
 private:
     DyeField densityPrev;
     VelocityField velocityPrev;
 
+    // Preallocated workspaces, shared by the threads stepping the system. Each
+    // coordinate has its own so that coordinates can be stepped concurrently.
+    DyeField densityCompensation;
+    VelocityField velocityCompensation;
+    DyeField densityWorkspace;
+    VelocityField velocityWorkspace;
+    VelocityField gradient;
+    Grid pressure, divergence, pressureWorkspace;
+
+    // Where the boundary conditions of the fields apply, with the halo exchange, if any.
+    // The dye and the pressure have Continuity conditions.
+    Boundaries densityBoundaries() const;
+    Boundaries velocityBoundaries() const;
+    Boundaries pressureBoundaries() const;
+    // Kernels instantiated for the boundary conditions of a field, so that the runtime
+    // toggles only pick among them
+    struct FieldKernels {
+        void (*setBoundaries)(Grid &grid, const Boundaries &boundaries);
+        void (*subtractGradient)(Grid &component, const Grid &pressure, std::size_t axis,
+                                 const Location &spacing, const Boundaries &boundaries);
+        void (FluidSystem::*diffuse)(Grid &out, Grid &in, Grid &workspace,
+                                     const Diffusion &diffusion, const Indices &dim,
+                                     const Boundaries &boundaries,
+                                     const Addition *addition) const;
+        void (FluidSystem::*advect)(Grid &out, const Grid &in, Grid &compensation,
+                                    const VelocityField &velocity, Scalar dt,
+                                    const Indices &dim, const Boundaries &boundaries) const;
+    };
+    template<Grid::Index numStaggers, typename Policy>
+    static FieldKernels fieldKernels();
+    // Those of each velocity component, as horizontalNeumann and verticalNeumann pick them
+    std::array<FieldKernels, VelocityField::coords> velocityKernels() const;
+    // Those of the velocity component along x or y, with Neumann conditions if given on the
+    // sides which are not open
+    template<int Axis>
+    FieldKernels wallKernels(bool neumann) const;
+
+    // The sources declared sparse, and their spans
+    const DyeField *sparseDensitySource = nullptr;
+    const SourceSpans *densitySourceSpans = nullptr;
+    const VelocityField *sparseVelocitySource = nullptr;
+    const SourceSpans *velocitySourceSpans = nullptr;
+    // Those of a source, if it has been declared sparse
+    const SourceSpans *sourceSpans(const DyeField &source) const;
+    const SourceSpans *sourceSpans(const VelocityField &source) const;
+
+    // Steps and time since the last velocity update
+    int heldSteps = 0;
+    Scalar heldTime = 0;
+    bool velocityUpdateRequested = false;
+    const VelocityField *lastAddedVelocity = nullptr;
+    Scalar lastPeakSpeed = 0;
+    void adaptVelocityInterval();
+    bool velocityAtRest = false;
+    // Puts the flow to rest if it is still enough
+    void checkRest(const VelocityField &addedVelocity);
+
+    // Start of the phase being timed, only touched by the master thread
+    double phaseStart;
+    // Adds the time since the last mark to a phase; every thread of the team calls it
+    // once the phase's kernels are done
+    void markPhase(Phase phase);
+    // Wraps the work of a task graph task so that it adds its wall time to a phase, scaled
+    // by the share of the graph's team which the task occupies
+    std::function<void()> timedTask(Phase phase, std::function<void()> work);
+
+    // Skips the velocity update if velocityDt is zero
+    void stepTaskGraph(Scalar dt, Scalar velocityDt, const DyeField &addedDensity,
+                       const VelocityField &addedVelocity);
+
+    // The following are kernels in the sense of math.h: the data-parallel schedule runs
+    // them all in a single parallel region, so every thread of the team must call them
     void stepDensity(Scalar dt, const DyeField &addedDensity);
     void stepVelocity(Scalar dt, const VelocityField &addedVelocity);
 
-    template<Grid::Index numStaggers, std::size_t numCoords>
-    void diffuse(VectorField<numStaggers, numCoords> &out,
-                 const VectorField<numStaggers, numCoords> &in,
-                 Scalar diffusionConstant, Scalar dt, const Indices &dim,
-                 std::array<BoundarySetter, numCoords> setBoundaries) const;
-    template<Grid::Index numStaggers, std::size_t numCoords>
-    void advect(VectorField<numStaggers, numCoords> &out,
-                const VectorField<numStaggers, numCoords> &in,
+    // Adds added * dt to a field, over the spans alone if given, and exchanges its halos
+    template<typename Field>
+    void addSources(Field &field, const Field &added, Scalar dt, const SourceSpans *spans);
+    // Whether diffusion adds the dense sources of a field, instead of a pass of their own
+    bool diffusionAddsSources(const Diffusion &diffusion) const;
+    // Adds the addition, if given, to in first
+    template<typename Policy>
+    void diffuse(Grid &out, Grid &in, Grid &workspace, const Diffusion &diffusion,
+                 const Indices &dim, const Boundaries &boundaries,
+                 const Addition *addition = nullptr) const;
+    template<Grid::Index numStaggers, typename Policy>
+    void advect(Grid &out, const Grid &in, Grid &compensation,
                 const VelocityField &velocity, Scalar dt, const Indices &dim,
-                std::array<BoundarySetter, numCoords> setBoundaries) const;
-    template<Grid::Index numStaggers, std::size_t numCoords>
-    void backtrace(VectorField<numStaggers, numCoords> &out,
-                   const VectorField<numStaggers, numCoords> &in,
-                   const VelocityField &velocity, Scalar dt, const Indices &dim) const;
-    void project(VelocityField &u) const;
+                const Boundaries &boundaries) const;
+    // Sets the faces of out as it goes, leaving the corners to finishBoundaries(). peak
+    // bounds the magnitude of each component of the velocity, as peakVelocity() gives it.
+    template<Grid::Index numStaggers, typename Policy>
+    void backtrace(Grid &out, const Grid &in, const VelocityField &velocity,
+                   const Location &peak, Scalar dt, const Indices &dim,
+                   const Boundaries &boundaries) const;
+    // Backtraces single cells (i, j, k) of a field through the data of the grids, clamping
+    // the positions a backtrace passes through to [0.5, dim + 0.5] unless they are known
+    // to stay there
+    template<Grid::Index numStaggers>
+    struct Backtracer {
+        Backtracer(const Grid &in, const VelocityField &velocity,
+                   const Location &cellsPerLength, const Indices &dim, Scalar dt);
+        template<bool clamped>
+        Scalar trace(Grid::Index i, Grid::Index j, Grid::Index k) const;
+
+        const Scalar *in;
+        const Grid::Index inRow, inPlane;
+        const std::array<const Scalar *, kGridDimensions> velocity;
+        const Grid::Index row, plane;
+        const Location cellsPerLength, upper;
+        const Scalar dt;
+    };
+    // Backtraces dye through a coarser velocity, interpolated trilinearly at the dye cells
+    // (so with Continuity conditions)
+    void upsampledBacktrace(Grid &out, const Grid &in, const VelocityField &velocity,
+                            const Location &peak, Scalar dt,
+                            const Boundaries &boundaries) const;
+    template<bool clamped>
+    Scalar upsampledBacktraceCell(const Grid &in, const VelocityField &velocity,
+                                  const Location &upper, Scalar dt, Grid::Index i,
+                                  Grid::Index j, Grid::Index k) const;
+    // The cells whose backtraces cannot leave [0.5, dim + 0.5], and so need no clamping,
+    // given how many cells a backtrace may reach along each axis at most
+    struct Band {
+        Indices begin, end;
+        // Cells begin to end of row (j, k) are within the band
+        void row(Grid::Index j, Grid::Index k, Grid::Index &begin, Grid::Index &end) const;
+    };
+    static Band interiorBand(const Indices &dim, const Location &reach);
+    // Velocity, in dye cells per unit time, at a position in the frame of the dye
+    Location upsampledVelocity(const VelocityField &velocity, const Location &x) const;
+    // Also measures the activity of u, if given somewhere to put it
+    void project(VelocityField &u, FlowActivity *activity = nullptr);
+    // Subtracts the gradient of the pressure along an axis from the velocity component along
+    // it, and sets the component's boundaries as it goes
+    template<typename Policy>
+    static void subtractGradient(Grid &component, const Grid &pressure, std::size_t axis,
+                                 const Location &spacing, const Boundaries &boundaries);
 };
 
-void grad(VelocityField &out, const Grid &in, const Indices &dim);
-void div(Grid &out, const VelocityField &in, const Indices &dim);
+void grad(VelocityField &out, const Grid &in, const Indices &dim,
+          const Location &spacing = Location::Ones());
+void div(Grid &out, const VelocityField &in, const Indices &dim,
+         const Location &spacing = Location::Ones(), FlowActivity *activity = nullptr);
+// The divergence negated, over the cells within the boundaries, which it sets (with
+// Continuity conditions) as it goes, in one sweep instead of three
+void negatedDiv(Grid &out, const VelocityField &in, const Location &spacing,
+                const Boundaries &boundaries, FlowActivity *activity = nullptr);
+// Largest velocity component over the interior, in one pass over all components; not a
+// kernel, so it must be called outside of parallel regions
+Scalar maxSpeed(const VelocityField &velocity, const Indices &staggeredDim);
+// Largest magnitude of each velocity component over its whole grid, ghost cells included,
+// so that it bounds any interpolation of the component. A kernel, though a single thread
+// does the work, and every thread gets the result.
+Location peakVelocity(const VelocityField &velocity);
+// Resample a grid over the same extent from cells of dimensions inDim to those of outDim.
+// A concentration (e.g. of dye) is averaged over the overlaps of the cells, so that its
+// total is conserved; a velocity component along some axis is interpolated trilinearly,
+// with dimensions those of the cell-centered velocity cells. Not kernels, so they must be
+// called outside of parallel regions.
+void resampleConcentration(Grid &out, const Indices &outDim, const Grid &in,
+                           const Indices &inDim);
+void resampleVelocity(Grid &out, const Indices &outDim, const Grid &in, const Indices &inDim,
+                      Grid::Index axis);
 
 #include "fluidsystem.tpp"
 
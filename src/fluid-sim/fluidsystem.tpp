@@ -1,81 +1,147 @@
 #include "fluidsystem.h"
 
-template<Grid::Index numStaggers, std::size_t numCoords>
-void FluidSystem::advect(VectorField<numStaggers, numCoords> &out,
-                         const VectorField<numStaggers, numCoords> &in,
-                         const VelocityField &velocity, Scalar dt, const Indices &dim,
-                         std::array<BoundarySetter, numCoords> boundarySetters) const {
-    backtrace(out, in, velocity, dt, dim);
-    for (std::size_t d = 0; d < numCoords; ++d) {
-        boundarySetters[d](out[d]);
-    }
-    VectorField<numStaggers, numCoords> outCompensation = out;
-    backtrace(outCompensation, out, velocity, -1 * dt, dim);
-    for (std::size_t d = 0; d < numCoords; ++d) {
-        boundarySetters[d](outCompensation[d]);
+template<Grid::Index numStaggers, typename Policy>
+FluidSystem::FieldKernels FluidSystem::fieldKernels() {
+    return {&setBoundaries<Policy>, &FluidSystem::subtractGradient<Policy>,
+            &FluidSystem::diffuse<Policy>, &FluidSystem::advect<numStaggers, Policy>};
+}
+template<int Axis>
+FluidSystem::FieldKernels FluidSystem::wallKernels(bool neumann) const {
+    const std::array<bool, 2> &open = openSides[Axis];
+    if (!neumann || (open[0] && open[1])) return fieldKernels<3, Continuity>();
+    if (open[0]) return fieldKernels<3, OneSidedNeumann<Axis, 1> >();
+    if (open[1]) return fieldKernels<3, OneSidedNeumann<Axis, 0> >();
+    return fieldKernels<3, Neumann<Axis> >();
+}
+
+template<typename Field>
+void FluidSystem::addSources(Field &field, const Field &added, Scalar dt,
+                             const SourceSpans *spans) {
+    if (spans) {
+        for (std::size_t d = 0; d < Field::coords; ++d) spans->add(field[d], added[d], dt);
+    } else {
+        field += added * dt;
     }
-    out = in + 0.5 * (in - outCompensation);
-    for (std::size_t d = 0; d < numCoords; ++d) {
-        boundarySetters[d](out[d]);
+    if (exchangeHalos) {
+        for (std::size_t d = 0; d < Field::coords; ++d) exchangeHalos(field[d]);
     }
-    backtrace(out, in, velocity, dt, dim);
 }
-template<Grid::Index numStaggers, std::size_t numCoords>
-void FluidSystem::backtrace(VectorField<numStaggers, numCoords> &out,
-                            const VectorField<numStaggers, numCoords> &in,
-                            const VelocityField &velocity, Scalar dt, const Indices &dim) const {
-#pragma omp parallel for collapse(2)
-    for (std::size_t d = 0; d < numCoords; ++d) {
-        for (Grid::Index i = 1; i <= dim(0); ++i) {
-            for (Grid::Index j = 1; j <= dim(1); ++j) {
-                for (Grid::Index k = 1; k <= dim(2); ++k) {
-                    // Backtrack to the midpoint of RK2
-                    Location x = { // position relative to the frame of the field
-                      static_cast<Scalar>(i), static_cast<Scalar>(j),
-                      static_cast<Scalar>(k)
-                    };
-                    Location v;
-                    for (Location::Index l = 0; l < kGridDimensions; ++l) {
-                        if (l < numStaggers) {
-                            // average the (face-centered) velocities to get
-                            // cell-centered velocity since out[l] is cell-centered
-                            if (l == 0) {
-                                v[l] = (velocity[l](i, j, k) + velocity[l](i + 1, j, k)) / 2;
-                            } else if (l == 1) {
-                                v[l] = (velocity[l](i, j, k) + velocity[l](i, j + 1, k)) / 2;
-                            } else if (l == 2) {
-                                v[l] = (velocity[l](i, j, k) + velocity[l](i, j, k + 1)) / 2;
-                            }
-                        } else {
-                            // use face-centered velocity, since out[l] is face-centered
-                            v[l] = velocity[l](i, j, k);
-                        }
-                    }
-                    Location xMidpoint = x - 0.5 * dt * v;
-                    // Clamp the midpoint position relative to the frame of the field
-                    xMidpoint = xMidpoint.min(dim.cast<Scalar>() + 0.5f).max(0.5);
-                    // Find the velocity at the RK2 midpoint
-                    Location velocityMidpoint;
-                    for (Location::Index l = 0; l < kGridDimensions; ++l) {
-                        velocityMidpoint[l] = interpolate(velocity[l], xMidpoint);
-                    }
-                    // Interpolate at the final position relative to the frame of the field
-                    x = x - dt * velocityMidpoint;
-                    x = x.min(dim.cast<Scalar>() + 0.5f).max(0.5);
-                    out[d](i, j, k) = interpolate(in[d], x);
-                }
+
+template<typename Policy>
+void FluidSystem::subtractGradient(Grid &component, const Grid &pressure, std::size_t axis,
+                                   const Location &spacing, const Boundaries &boundaries) {
+    if (omp_get_level() == 0) {
+#pragma omp parallel
+        subtractGradient<Policy>(component, pressure, axis, spacing, boundaries);
+        return;
+    }
+    const Indices &dim = boundaries.dim;
+    const Scalar weight = 0.5f / spacing(axis);
+    const Grid::Index di = axis == 0, dj = axis == 1, dk = axis == 2;
+    sweepRows<Policy>(component, dim(1), boundaries, [&](Grid::Index j) {
+        for (Grid::Index k = 1; k <= dim(2); ++k) {
+            for (Grid::Index i = 1; i <= dim(0); ++i) {
+                component(i, j, k) -= weight * (pressure(i + di, j + dj, k + dk) -
+                                                pressure(i - di, j - dj, k - dk));
             }
         }
+    });
+    finishBoundaries(component, boundaries);
+}
+
+template<Grid::Index numStaggers, typename Policy>
+void FluidSystem::advect(Grid &out, const Grid &in, Grid &outCompensation,
+                         const VelocityField &velocity, Scalar dt, const Indices &dim,
+                         const Boundaries &boundaries) const {
+    const Location peak = peakVelocity(velocity);
+    if (advection == kAdvectionSemiLagrangian) {
+        backtrace<numStaggers, Policy>(out, in, velocity, peak, dt, dim, boundaries);
+        finishBoundaries(out, boundaries);
+        return;
     }
+    backtrace<numStaggers, Policy>(out, in, velocity, peak, dt, dim, boundaries);
+    finishBoundaries(out, boundaries);
+    // The backtrace leaves the edges as they are, so they come from out
+    parallelAssign(outCompensation, out, AssignOp());
+    backtrace<numStaggers, Policy>(outCompensation, out, velocity, peak, -1 * dt, dim,
+                                   boundaries);
+    finishBoundaries(outCompensation, boundaries);
+    // Advect the input corrected by half the round-trip error. Its faces mirror its interior
+    // as those of both terms do, so only the corners need setting again.
+    parallelAssign(outCompensation, in + 0.5f * (in - outCompensation), AssignOp());
+    finishBoundaries(outCompensation, boundaries);
+    backtrace<numStaggers, Policy>(out, outCompensation, velocity, peak, dt, dim, boundaries);
+    finishBoundaries(out, boundaries);
 }
+template<Grid::Index numStaggers, typename Policy>
+void FluidSystem::backtrace(Grid &out, const Grid &in, const VelocityField &velocity,
+                            const Location &peak, Scalar dt, const Indices &dim,
+                            const Boundaries &boundaries) const {
+    if (numStaggers == 0 && velocityScale > 1) {
+        upsampledBacktrace(out, in, velocity, peak, dt, boundaries);
+        return;
+    }
+    // Velocities are in lengths per unit time, and positions in cells of the velocity grid
+    const Location cellsPerLength = 1 / velocitySpacing();
+    const Band band = interiorBand(dim, std::abs(dt) * peak * cellsPerLength);
+    const Backtracer<numStaggers> backtracer(in, velocity, cellsPerLength, dim, dt);
+    sweepRows<Policy>(out, dim(1), boundaries, [&](Grid::Index j) {
+        for (Grid::Index k = 1; k <= dim(2); ++k) {
+            Grid::Index begin, end;
+            band.row(j, k, begin, end);
+            for (Grid::Index i = 1; i < begin; ++i) {
+                out(i, j, k) = backtracer.template trace<true>(i, j, k);
+            }
+            for (Grid::Index i = begin; i <= end; ++i) {
+                out(i, j, k) = backtracer.template trace<false>(i, j, k);
+            }
+            for (Grid::Index i = std::max(begin, end + 1); i <= dim(0); ++i) {
+                out(i, j, k) = backtracer.template trace<true>(i, j, k);
+            }
+        }
+    });
+}
+
+template<Grid::Index numStaggers>
+FluidSystem::Backtracer<numStaggers>::Backtracer(const Grid &in, const VelocityField &velocity,
+                                                 const Location &cellsPerLength,
+                                                 const Indices &dim, Scalar dt) :
+    in(in.data()), inRow(in.dimension(0)), inPlane(in.dimension(0) * in.dimension(1)),
+    velocity({{velocity[0].data(), velocity[1].data(), velocity[2].data()}}),
+    row(velocity[0].dimension(0)), plane(velocity[0].dimension(0) * velocity[0].dimension(1)),
+    cellsPerLength(cellsPerLength), upper(dim.cast<Scalar>() + 0.5f), dt(dt) {}
 
-template<Grid::Index numStaggers, std::size_t numCoords>
-void FluidSystem::diffuse(VectorField<numStaggers, numCoords> &out,
-                          const VectorField<numStaggers, numCoords> &in,
-                          Scalar diff, Scalar dt, const Indices &dim,
-                          std::array<BoundarySetter, numCoords> boundarySetters) const {
-    Scalar a = dt * diff;
-    for (std::size_t d = 0; d < numCoords; ++d) {
-      linearSolve(out[d], in[d], a, 1 + 6 * a, dim, boundarySetters[d]);
+template<Grid::Index numStaggers>
+template<bool clamped>
+Scalar FluidSystem::Backtracer<numStaggers>::trace(Grid::Index i, Grid::Index j,
+                                                   Grid::Index k) const {
+    // Velocities of the cell, averaging the (face-centered) velocities along the staggered
+    // axes, since the field is cell-centered along those; along the others, the field is
+    // face-centered like the velocity
+    const Grid::Index cell = i + j * row + k * plane;
+    const std::array<Grid::Index, kGridDimensions> next = {{1, row, plane}};
+    std::array<Scalar, kGridDimensions> v;
+    for (std::size_t l = 0; l < kGridDimensions; ++l) {
+        v[l] = velocity[l][cell];
+        if (static_cast<Grid::Index>(l) < numStaggers) {
+            v[l] = (v[l] + velocity[l][cell + next[l]]) / 2;
+        }
+    }
+    // Backtrack to the midpoint of RK2, in the frame of the field
+    std::array<Scalar, kGridDimensions> x = {{static_cast<Scalar>(i), static_cast<Scalar>(j),
+                                              static_cast<Scalar>(k)}};
+    std::array<Scalar, kGridDimensions> midpoint;
+    const Scalar halfDt = 0.5f * dt;
+    for (std::size_t l = 0; l < kGridDimensions; ++l) {
+        midpoint[l] = x[l] - halfDt * (v[l] * cellsPerLength(l));
+        if (clamped) midpoint[l] = std::max(std::min(midpoint[l], upper(l)), 0.5f);
+    }
+    // Interpolate at the final position, found from the velocity at the midpoint
+    for (std::size_t l = 0; l < kGridDimensions; ++l) {
+        const Scalar velocityMidpoint = interpolate(velocity[l], row, plane, midpoint[0],
+                                                    midpoint[1], midpoint[2]);
+        x[l] = x[l] - dt * (velocityMidpoint * cellsPerLength(l));
+        if (clamped) x[l] = std::max(std::min(x[l], upper(l)), 0.5f);
     }
+    return interpolate(in, inRow, inPlane, x[0], x[1], x[2]);
 }
@@ -1,67 +1,13 @@
 #include "math.h"
 
-void linearSolve(Grid &x, const Grid &x_0, Scalar a, Scalar c, const Indices &dim,
-                 BoundarySetter setBoundaries, unsigned int iterations) {
-    x = x_0;
-    if (a == 0) {
-        setBoundaries(x);
-        return;
-    }
-
-    Grid temp = x_0;
-    for (unsigned int iteration = 0; iteration < iterations; ++iteration) {
-#pragma omp parallel for
-        for (Grid::Index i = 1; i <= dim(0); ++i) {
-            for (Grid::Index j = 1; j <= dim(1); ++j) {
-                for (Grid::Index k = 1; k <= dim(2); ++k) {
-                    temp(i, j, k) = (x_0(i, j, k) +
-                                     a * (x(i - 1, j, k) + x(i + 1, j, k) +
-                                          x(i, j - 1, k) + x(i, j + 1, k) +
-                                          x(i, j, k - 1) + x(i, j, k + 1))) / c;
-                }
-            }
-        }
-        x = temp;
+#include <utility>
 
-        setBoundaries(x);
-   }
-}
+namespace {
 
-Scalar interpolate(const Grid &grid, Location x) {
-    Indices i = x.cast<Grid::Index>();
-    Indices j = i + 1;
-    Location t = x - i.cast<Scalar>();
-    Location s = 1 - t;
-    return (s[2] * (s[1] * (s[0] * grid(i[0], i[1], i[2]) +
-                            t[0] * grid(j[0], i[1], i[2])) +
-                    t[1] * (s[0] * grid(i[0], j[1], i[2]) +
-                            t[0] * grid(j[0], j[1], i[2]))) +
-            t[2] * (s[1] * (s[0] * grid(i[0], i[1], j[2]) +
-                            t[0] * grid(j[0], i[1], j[2])) +
-                    t[1] * (s[0] * grid(i[0], j[1], j[2]) +
-                            t[0] * grid(j[0], j[1], j[2]))));
-}
-
-void setBoundaries(Grid &grid, int b, const Indices &dim) {
-    for(Grid::Index j = 1; j <= dim(1); ++j) {
-        for (Grid::Index k = 1; k <= dim(2); ++k) {
-            grid(0, j, k) = (b == 0 ? -1 : 1) * grid(1, j, k);
-            grid(dim(0) + 1, j, k) = (b == 0 ? -1 : 1) * grid(dim(0), j, k);
-        }
-    }
-    for (Grid::Index i = 1; i <= dim(0); ++i) {
-        for (Grid::Index k = 1; k <= dim(2); ++k) {
-            grid(i, 0, k) = (b == 1 ? -1 : 1) * grid(i, 1, k);
-            grid(i, dim(1) + 1, k) = (b == 1 ? -1 : 1) * grid(i, dim(1), k);
-        }
-    }
-    for (Grid::Index i = 1; i <= dim(0); ++i) {
-        for (Grid::Index j = 1; j <= dim(1); ++j) {
-            grid(i, j, 0) = (b == 2 ? -1 : 1) * grid(i, j, 1);
-            grid(i, j, dim(2) + 1) = (b == 2 ? -1 : 1) * grid(i, j, dim(2));
-        }
-    }
+bool specialized = true;
 
+// Sets the corner ghost cells of a grid from the edge ghost cells next to them
+void setCorners(Grid &grid, const Indices &dim) {
     grid(0, 0, 0) = (grid(1, 0, 0) + grid(0, 1, 0) + grid(0, 0, 1)) / 3;
     grid(dim(0) + 1, 0, 0) = (grid(dim(0), 0, 0) + grid(dim(0) + 1, 1, 0) +
                               grid(dim(0) + 1, 0, 1)) / 3;
@@ -82,15 +28,248 @@ void setBoundaries(Grid &grid, int b, const Indices &dim) {
                                                 grid(dim(0) + 1, dim(1), dim(2) + 1) +
                                                 grid(dim(0) + 1, dim(1) + 1, dim(2))) / 3;
 }
-void setContinuityBoundaries(Grid &grid, const Indices &dim) {
-    setBoundaries(grid, -1, dim);
+
+// Copies initial into the grid a solve starts from, and into the second one too, if given,
+// adding the addition, if any, to initial in the same pass
+void startFrom(Grid &initial, const Addition *addition, Grid &start, Grid *second) {
+    if (!addition) {
+        parallelAssign(start, initial, AssignOp());
+        if (second) parallelAssign(*second, initial, AssignOp());
+        return;
+    }
+    const Grid::Index rowLength = initial.dimension(0);
+    const Grid::Index planeLength = rowLength * initial.dimension(1);
+    Grid::Index begin, end;
+    threadYRows(initial, begin, end);
+    Scalar *values = initial.data();
+    const Scalar *added = addition->grid.data();
+    const Scalar scale = addition->scale;
+    Scalar *copy = start.data();
+    Scalar *secondCopy = second ? second->data() : nullptr;
+    for (Grid::Index plane = 0; plane < initial.dimension(2) * planeLength;
+         plane += planeLength) {
+        for (Grid::Index n = plane + begin * rowLength; n < plane + end * rowLength; ++n) {
+            values[n] = values[n] + added[n] * scale;
+            copy[n] = values[n];
+            if (secondCopy) secondCopy[n] = values[n];
+        }
+    }
+#pragma omp barrier
+}
+
+// Runs the sweep specialized for the dimensions of a grid, if there is one
+template<template<Grid::Index, Grid::Index, Grid::Index> class Sweep, typename Policy,
+         typename... Arguments>
+void sweep(const Grid &grid, const Indices &dim, Arguments&&... arguments) {
+    if (!specialized) {
+        Sweep<0, 0, 0>::template run<Policy>(std::forward<Arguments>(arguments)..., dim);
+        return;
+    }
+    for (const auto &kernel : SpecializedSweeps<Sweep, Policy>::kernels) {
+        const TensorIndices &shape = kernel.first;
+        if (dim(0) == shape[0] && dim(1) == shape[1] && dim(2) == shape[2] &&
+            grid.dimension(0) == shape[0] + 2 && grid.dimension(1) == shape[1] + 2) {
+            kernel.second(std::forward<Arguments>(arguments)..., dim);
+            return;
+        }
+    }
+    switch (dim(2)) {
+    case 1:
+        Sweep<0, 0, 1>::template run<Policy>(std::forward<Arguments>(arguments)..., dim);
+        break;
+    case 2:
+        Sweep<0, 0, 2>::template run<Policy>(std::forward<Arguments>(arguments)..., dim);
+        break;
+    case 3:
+        Sweep<0, 0, 3>::template run<Policy>(std::forward<Arguments>(arguments)..., dim);
+        break;
+    case 4:
+        Sweep<0, 0, 4>::template run<Policy>(std::forward<Arguments>(arguments)..., dim);
+        break;
+    case 5:
+        Sweep<0, 0, 5>::template run<Policy>(std::forward<Arguments>(arguments)..., dim);
+        break;
+    case 6:
+        Sweep<0, 0, 6>::template run<Policy>(std::forward<Arguments>(arguments)..., dim);
+        break;
+    case 7:
+        Sweep<0, 0, 7>::template run<Policy>(std::forward<Arguments>(arguments)..., dim);
+        break;
+    case 8:
+        Sweep<0, 0, 8>::template run<Policy>(std::forward<Arguments>(arguments)..., dim);
+        break;
+    default:
+        Sweep<0, 0, 0>::template run<Policy>(std::forward<Arguments>(arguments)..., dim);
+        break;
+    }
+    static_assert(kMaxSpecializedDepth == 8, "Every specialized depth needs a case");
 }
-void setHorizontalNeumannBoundaries(Grid &grid, const Indices &dim) {
-    setBoundaries(grid, 0, dim);
+
 }
-void setVerticalNeumannBoundaries(Grid &grid, const Indices &dim) {
-    setBoundaries(grid, 1, dim);
+
+void setSpecializedKernels(bool enabled) {
+    specialized = enabled;
+}
+bool specializedKernels() {
+    return specialized;
+}
+
+void threadRows(Grid::Index numRows, Grid::Index &begin, Grid::Index &end) {
+    const Grid::Index numThreads = omp_get_num_threads();
+    const Grid::Index thread = omp_get_thread_num();
+    Grid::Index blockSize = numRows / numThreads;
+    Grid::Index remainder = numRows % numThreads;
+    if (thread < remainder) {
+        ++blockSize;
+        remainder = 0;
+    }
+    begin = thread * blockSize + remainder;
+    end = begin + blockSize;
 }
-void setDepthNeumannBoundaries(Grid &grid, const Indices &dim) {
-    setBoundaries(grid, 2, dim);
+
+void threadYRows(const Grid &grid, Grid::Index &begin, Grid::Index &end) {
+    const Grid::Index height = grid.dimension(1);
+    threadRows(std::max<Grid::Index>(height - 2, 0), begin, end);
+    ++begin;
+    ++end;
+    if (omp_get_thread_num() == 0) begin = 0;
+    if (omp_get_thread_num() == omp_get_num_threads() - 1) end = height;
+}
+
+template<typename Policy>
+void linearSolve(Grid &x, Grid &x_0, Grid &temp, const Location &a, Scalar c,
+                 const Indices &dim, const Boundaries &boundaries, unsigned int iterations,
+                 const Addition *addition) {
+    if (omp_get_level() == 0) {
+#pragma omp parallel
+        linearSolve<Policy>(x, x_0, temp, a, c, dim, boundaries, iterations, addition);
+        return;
+    }
+
+    if ((a == 0).all()) {
+        startFrom(x_0, addition, x, nullptr);
+        setBoundaries<Policy>(x, boundaries);
+        return;
+    }
+    // The last iteration of an odd number lands in temp, so its edges must match x
+    startFrom(x_0, addition, x, iterations % 2 ? &temp : nullptr);
+
+    // Alternate between x and temp instead of copying temp back every iteration. The
+    // sweeps never read the corners, so those are only set once at the end, unless the
+    // halos must be exchanged after every iteration.
+    const bool exchangeHalos = boundaries.exchangeHalos;
+    Grid *source = &x;
+    Grid *target = &temp;
+    for (unsigned int iteration = 0; iteration < iterations; ++iteration) {
+        sweep<JacobiSweep, Policy>(x, dim, *target, *source, x_0, a, c, boundaries);
+        if (exchangeHalos) finishBoundaries(*target, boundaries);
+        std::swap(source, target);
+    }
+    if (source != &x) {
+        parallelAssign(x, *source, AssignOp());
+    }
+    if (!exchangeHalos) finishBoundaries(x, boundaries);
+}
+
+template<typename Policy>
+void explicitDiffusion(Grid &x, Grid &x_0, Grid &temp, const Location &a,
+                       const Indices &dim, const Boundaries &boundaries, unsigned int sweeps,
+                       const Addition *addition) {
+    if (omp_get_level() == 0) {
+#pragma omp parallel
+        explicitDiffusion<Policy>(x, x_0, temp, a, dim, boundaries, sweeps, addition);
+        return;
+    }
+
+    // Start from whichever grid makes the last sweep land in x
+    Grid *source = sweeps % 2 ? &temp : &x;
+    Grid *target = sweeps % 2 ? &x : &temp;
+    startFrom(x_0, addition, *source, nullptr);
+    setBoundaries<Policy>(*source, boundaries);
+    // As in linearSolve, the corners wait for the last sweep if they can
+    const bool exchangeHalos = boundaries.exchangeHalos;
+    const Location b = a / sweeps;
+    for (unsigned int i = 0; i < sweeps; ++i) {
+        sweep<ExplicitSweep, Policy>(x, dim, *target, *source, b, boundaries);
+        if (exchangeHalos) finishBoundaries(*target, boundaries);
+        std::swap(source, target);
+    }
+    if (!exchangeHalos) finishBoundaries(x, boundaries);
+}
+
+Scalar interpolate(const Grid &grid, Location x) {
+    return interpolate(grid.data(), grid.dimension(0), grid.dimension(0) * grid.dimension(1),
+                       x[0], x[1], x[2]);
+}
+
+template<typename Policy>
+void setBoundaries(Grid &grid, const Boundaries &boundaries) {
+    if (omp_get_level() == 0) {
+#pragma omp parallel
+        setBoundaries<Policy>(grid, boundaries);
+        return;
+    }
+
+    const Indices &dim = boundaries.dim;
+    // Faces only write ghost cells and only read interior cells, so they need no barriers
+#pragma omp for collapse(2) schedule(static) nowait
+    for (Grid::Index k = 1; k <= dim(2); ++k) {
+        for(Grid::Index j = 1; j <= dim(1); ++j) {
+            grid(0, j, k) = Policy::mirror(0, 0) * grid(1, j, k);
+            grid(dim(0) + 1, j, k) = Policy::mirror(0, 1) * grid(dim(0), j, k);
+        }
+    }
+#pragma omp for schedule(static) nowait
+    for (Grid::Index k = 1; k <= dim(2); ++k) {
+        for (Grid::Index i = 1; i <= dim(0); ++i) {
+            grid(i, 0, k) = Policy::mirror(1, 0) * grid(i, 1, k);
+            grid(i, dim(1) + 1, k) = Policy::mirror(1, 1) * grid(i, dim(1), k);
+        }
+    }
+#pragma omp for schedule(static) nowait
+    for (Grid::Index j = 1; j <= dim(1); ++j) {
+        for (Grid::Index i = 1; i <= dim(0); ++i) {
+            grid(i, j, 0) = Policy::mirror(2, 0) * grid(i, j, 1);
+            grid(i, j, dim(2) + 1) = Policy::mirror(2, 1) * grid(i, j, dim(2));
+        }
+    }
+
+    // Corners only read edge ghost cells; the implicit barrier of single completes the faces
+    finishBoundaries(grid, boundaries);
+}
+void finishBoundaries(Grid &grid, const Boundaries &boundaries) {
+    if (omp_get_level() == 0) {
+#pragma omp parallel
+        finishBoundaries(grid, boundaries);
+        return;
+    }
+
+#pragma omp single
+    setCorners(grid, boundaries.dim);
+    if (boundaries.exchangeHalos) (*boundaries.exchangeHalos)(grid);
+}
+
+#define INSTANTIATE_KERNELS(Policy) \
+    template void linearSolve<Policy>(Grid &, Grid &, Grid &, const Location &, Scalar, \
+                                      const Indices &, const Boundaries &, unsigned int, \
+                                      const Addition *); \
+    template void explicitDiffusion<Policy>(Grid &, Grid &, Grid &, const Location &, \
+                                            const Indices &, const Boundaries &, \
+                                            unsigned int, const Addition *); \
+    template void setBoundaries<Policy>(Grid &, const Boundaries &);
+INSTANTIATE_KERNELS(Continuity)
+INSTANTIATE_KERNELS(Neumann<0>)
+INSTANTIATE_KERNELS(Neumann<1>)
+INSTANTIATE_KERNELS(Neumann<2>)
+// Named, since the commas of their template arguments would split the macro's argument
+namespace {
+typedef OneSidedNeumann<0, 0> FirstXWall;
+typedef OneSidedNeumann<0, 1> LastXWall;
+typedef OneSidedNeumann<1, 0> FirstYWall;
+typedef OneSidedNeumann<1, 1> LastYWall;
 }
+INSTANTIATE_KERNELS(FirstXWall)
+INSTANTIATE_KERNELS(LastXWall)
+INSTANTIATE_KERNELS(FirstYWall)
+INSTANTIATE_KERNELS(LastYWall)
+#undef INSTANTIATE_KERNELS
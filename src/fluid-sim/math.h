@@ -1,8 +1,14 @@
 #ifndef MATH_H
 #define MATH_H
 
+#include <algorithm>
 #include <array>
+#include <functional>
 
+#include <omp.h>
+
+// Makes Eigen::ThreadPoolDevice available for parallel evaluation of tensor expressions
+#define EIGEN_USE_THREADS
 #include <unsupported/Eigen/CXX11/Tensor>
 
 typedef float Scalar;
@@ -13,18 +19,207 @@ typedef Eigen::Array<Grid::Index, kGridDimensions, 1> Indices;
 typedef std::array<Grid::Index, kGridDimensions> TensorIndices;
 typedef std::function<void(Grid&)> BoundarySetter;
 
-void linearSolve(Grid &solution, const Grid &initial, Scalar alpha, Scalar beta,
-                 const Indices &dim, BoundarySetter setBoundaries,
-                 unsigned int iterations = 20);
+// Kernels are orphaned OpenMP worksharing constructs. Called by every thread of a
+// parallel region, they split their work among the team and synchronize before
+// returning; called outside of any parallel region, they open their own. This lets
+// FluidSystem run a whole step in one persistent parallel region.
+
+// Splits numRows rows into contiguous blocks, one per thread of the enclosing parallel
+// region, the same way schedule(static) splits a loop over those rows
+void threadRows(Grid::Index numRows, Grid::Index &begin, Grid::Index &end);
+// The block of y rows [begin, end) of a grid, over all of its planes, which the calling
+// thread sweeps in sweepRows(): the interior rows are split as threadRows() splits them,
+// and the first and last threads also take the ghost rows before and after them
+void threadYRows(const Grid &grid, Grid::Index &begin, Grid::Index &end);
+
+// Evaluates an assignment over the calling thread's block of y rows of out, as
+// threadYRows() splits them, without synchronizing. The expression is a Grid or any
+// elementwise tensor expression of the same dimensions; its coefficients are evaluated
+// directly at the offsets of out's data, and the assignment is called with each pair.
+template<typename Expression, typename Assignment>
+void assignThreadRows(Grid &out, const Expression &expression, Assignment assignment) {
+    const Eigen::DefaultDevice device;
+    Eigen::TensorEvaluator<const Expression, Eigen::DefaultDevice> evaluator(expression, device);
+    evaluator.evalSubExprsIfNeeded(nullptr);
+    const Grid::Index rowLength = out.dimension(0);
+    const Grid::Index planeLength = rowLength * out.dimension(1);
+    Grid::Index begin, end;
+    threadYRows(out, begin, end);
+    Scalar *values = out.data();
+    for (Grid::Index plane = 0; plane < out.dimension(2) * planeLength; plane += planeLength) {
+        const Grid::Index last = plane + end * rowLength;
+        for (Grid::Index n = plane + begin * rowLength; n < last; ++n) {
+            assignment(values[n], evaluator.coeff(n));
+        }
+    }
+    evaluator.cleanup();
+}
+// Evaluates an assignment in parallel with the row partition of the kernels
+template<typename Expression, typename Assignment>
+void parallelAssign(Grid &out, const Expression &expression, Assignment assignment) {
+    if (omp_get_level() == 0) {
+#pragma omp parallel
+        parallelAssign(out, expression, assignment);
+        return;
+    }
+    assignThreadRows(out, expression, assignment);
+#pragma omp barrier
+}
+struct AssignOp {
+    void operator()(Scalar &lhs, Scalar rhs) const { lhs = rhs; }
+};
+struct AddAssignOp {
+    void operator()(Scalar &lhs, Scalar rhs) const { lhs += rhs; }
+};
+struct SubtractAssignOp {
+    void operator()(Scalar &lhs, Scalar rhs) const { lhs -= rhs; }
+};
+
+// Boundary conditions, as policies which kernels take as template parameters, so that they
+// are resolved at compile time. The ghost cells of a face mirror the interior cells next to
+// it, times mirror(axis, side) for the axis normal to the face and the side it is on (0 for
+// the first face along the axis, 1 for the last): Continuity keeps their values, and
+// Neumann<Axis> negates them on the faces normal to Axis, so that a velocity component
+// along Axis does not flow through those faces. OneSidedNeumann<Axis, Side> only negates
+// them on one of those faces, for a part of a domain which meets a wall on that side alone.
+struct Continuity {
+    static constexpr Scalar mirror(int, int) { return 1; }
+};
+template<int Axis>
+struct Neumann {
+    static constexpr Scalar mirror(int axis, int) { return axis == Axis ? -1 : 1; }
+};
+template<int Axis, int Side>
+struct OneSidedNeumann {
+    static constexpr Scalar mirror(int axis, int side) {
+        return axis == Axis && side == Side ? -1 : 1;
+    }
+};
+
+// Where the boundary conditions of a grid apply: the faces over the cells within dim, and
+// the corners, which average the ghost cells next to them; the edges are left as they
+// are. exchangeHalos, if given, is called once they are all set.
+struct Boundaries {
+    Indices dim;
+    const BoundarySetter *exchangeHalos;
+};
+
+// Sets the ghost cells of the faces which mirror rows first to last (inclusive) of the
+// interior, over all of its planes, without synchronizing. The bottom face goes with the
+// first row and the top face with row dim(1), which must be written by then. Sweeps call
+// this on the rows they have just written, so that they need no separate boundary pass.
+template<typename Policy>
+void setRowBoundaries(Grid &grid, const Boundaries &boundaries, Grid::Index first,
+                      Grid::Index last) {
+    const Indices &dim = boundaries.dim;
+    for (Grid::Index j = first; j <= std::min(last, dim(1)); ++j) {
+        for (Grid::Index k = 1; k <= dim(2); ++k) {
+            grid(0, j, k) = Policy::mirror(0, 0) * grid(1, j, k);
+            grid(dim(0) + 1, j, k) = Policy::mirror(0, 1) * grid(dim(0), j, k);
+        }
+        for (Grid::Index i = 1; i <= dim(0); ++i) {
+            grid(i, j, 0) = Policy::mirror(2, 0) * grid(i, j, 1);
+            grid(i, j, dim(2) + 1) = Policy::mirror(2, 1) * grid(i, j, dim(2));
+        }
+    }
+    if (first == 1) {
+        for (Grid::Index k = 1; k <= dim(2); ++k) {
+            for (Grid::Index i = 1; i <= dim(0); ++i) {
+                grid(i, 0, k) = Policy::mirror(1, 0) * grid(i, 1, k);
+            }
+        }
+    }
+    if (first <= dim(1) && dim(1) <= last) {
+        for (Grid::Index k = 1; k <= dim(2); ++k) {
+            for (Grid::Index i = 1; i <= dim(0); ++i) {
+                grid(i, dim(1) + 1, k) = Policy::mirror(1, 1) * grid(i, dim(1), k);
+            }
+        }
+    }
+}
+// Splits the rows 1 to numRows of a sweep among the threads as threadYRows() splits those
+// of out, so that each thread sweeps the rows it first touched, and synchronizes. Each row
+// is swept by sweepRow(j), and then the ghost cells which mirror it are set; the thread
+// with the last row within the boundaries also takes the rows past it, which some of those
+// ghost cells overwrite. The corners are left to finishBoundaries().
+template<typename Policy, typename RowSweep>
+void sweepRows(Grid &out, Grid::Index numRows, const Boundaries &boundaries,
+               RowSweep sweepRow) {
+    const Grid::Index lastFirst = std::min(numRows, boundaries.dim(1));
+    Grid::Index begin, end;
+    threadYRows(out, begin, end);
+    begin = std::max<Grid::Index>(begin, 1);
+    end = std::min(end, lastFirst + 1);
+    for (Grid::Index first = begin; first < end; ++first) {
+        const Grid::Index last = first < lastFirst ? first : numRows;
+        for (Grid::Index j = first; j <= last; ++j) sweepRow(j);
+        setRowBoundaries<Policy>(out, boundaries, first, last);
+    }
+#pragma omp barrier
+}
+// Sets the corners and exchanges the halos of a grid whose faces have been set, e.g. by
+// sweepRows()
+void finishBoundaries(Grid &grid, const Boundaries &boundaries);
+
+// Thin grids, up to this depth, are swept by solver kernels specialized for their depth.
+// Grids of the shapes registered by specializeKernels() have kernels compiled for all of
+// their dimensions.
+const Grid::Index kMaxSpecializedDepth = 8;
+// Compiles the solver kernels for grids with an interior of Width x Height x Depth, and has
+// them sweep such grids from now on; call it before starting any solver, e.g. with the
+// shapes of a program's dye and staggered velocity grids
+template<Grid::Index Width, Grid::Index Height, Grid::Index Depth>
+void specializeKernels();
+// Whether the solver kernels use their specialized variants (the default); results are the
+// same either way, so this is only for measuring them against the generic kernels
+void setSpecializedKernels(bool enabled);
+bool specializedKernels();
+
+// linearSolve, explicitDiffusion and setBoundaries are instantiated for Continuity, for
+// Neumann<0> to Neumann<2>, and for OneSidedNeumann along x and y.
+
+// scale * grid, for a solver to add to its initial grid in the pass which copies that in,
+// e.g. the sources of a step, so that they need no pass of their own
+struct Addition {
+    const Grid &grid;
+    Scalar scale;
+};
+
+// Jacobi solver of beta x - alpha . (sum of the neighbours of x along each axis) = initial;
+// workspace must have the same dimensions as solution. Each sweep sets the boundaries of
+// the cells it writes. An addition, if given, is added to initial first.
+template<typename Policy>
+void linearSolve(Grid &solution, Grid &initial, Grid &workspace,
+                 const Location &alpha, Scalar beta, const Indices &dim,
+                 const Boundaries &boundaries, unsigned int iterations = 20,
+                 const Addition *addition = nullptr);
+// Forward Euler diffusion with the diffusion number alpha along each axis, in sweeps of
+// alpha / sweeps each, which is stable while those sum to at most 1/2; workspace must have
+// the same dimensions as solution. An addition, if given, is added to initial first.
+template<typename Policy>
+void explicitDiffusion(Grid &solution, Grid &initial, Grid &workspace,
+                       const Location &alpha, const Indices &dim, const Boundaries &boundaries,
+                       unsigned int sweeps = 1, const Addition *addition = nullptr);
 
 // Linearly interpolates grid to nearest neighbors
 Scalar interpolate(const Grid &grid, Location x);
+// The same from the data of a grid, given the distances between its rows and planes
+inline Scalar interpolate(const Scalar *grid, Grid::Index row, Grid::Index plane,
+                          Scalar x, Scalar y, Scalar z) {
+    const Grid::Index i = x, j = y, k = z;
+    const Scalar tx = x - i, ty = y - j, tz = z - k;
+    const Scalar sx = 1 - tx, sy = 1 - ty, sz = 1 - tz;
+    const Scalar *corner = grid + i + j * row + k * plane;
+    return (sz * (sy * (sx * corner[0] + tx * corner[1]) +
+                  ty * (sx * corner[row] + tx * corner[row + 1])) +
+            tz * (sy * (sx * corner[plane] + tx * corner[plane + 1]) +
+                  ty * (sx * corner[plane + row] + tx * corner[plane + row + 1])));
+}
+
+// Sets boundary conditions on a grid, in a pass of its own
+template<typename Policy>
+void setBoundaries(Grid &grid, const Boundaries &boundaries);
 
-// Sets boundary conditions on grids
-void setBoundaries(Grid &grid, int b, const Indices &dim);
-void setContinuityBoundaries(Grid &grid, const Indices &dim);
-void setHorizontalNeumannBoundaries(Grid &grid, const Indices &dim);
-void setVerticalNeumannBoundaries(Grid &grid, const Indices &dim);
-void setDepthNeumannBoundaries(Grid &grid, const Indices &dim);
+#include "sweeps.tpp"
 
 #endif // MATH_H
@@ -0,0 +1,137 @@
+#include "partitionedfluidsystem.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+#include <omp.h>
+
+#include "taskgraph.h"
+
+PartitionedFluidSystem::PartitionedFluidSystem(Grid::Index width, Grid::Index height,
+                                               Grid::Index depth,
+                                               Scalar diffusionConstant, Scalar viscosity,
+                                               int numSubdomains, Grid::Index haloWidth) :
+    haloWidth(haloWidth), subdomains(numSubdomains), barrier(numSubdomains),
+    exchanging(numSubdomains, nullptr) {
+    if (haloWidth < 2 || height / numSubdomains < haloWidth + 2) {
+        throw std::invalid_argument("Each subdomain must own at least haloWidth + 2 >= 4 rows");
+    }
+    for (int s = 0; s < numSubdomains; ++s) {
+        layouts.push_back(slabLayout(height, numSubdomains, s, haloWidth));
+    }
+    // Each subdomain is allocated by a thread of its own team, so that its pages are
+    // first touched on that team's NUMA node
+#pragma omp parallel num_threads(numSubdomains) proc_bind(spread)
+    for (int s = omp_get_thread_num(); s < numSubdomains; s += omp_get_num_threads()) {
+        // Allocation zero-fills grids as a kernel of the enclosing team
+#pragma omp parallel num_threads(1)
+        subdomains[s] = std::make_shared<FluidSystem>(width, layouts[s].height, depth,
+                                                      diffusionConstant, viscosity);
+    }
+    for (int s = 0; s < numSubdomains; ++s) {
+        subdomains[s]->exchangeHalos = std::bind(&PartitionedFluidSystem::exchangeHalos, this,
+                                                 s, std::placeholders::_1);
+    }
+}
+
+void PartitionedFluidSystem::step(const std::vector<const DyeField *> &addedDensity,
+                                  const std::vector<const VelocityField *> &addedVelocity,
+                                  Scalar dt) {
+    // Bound how far a backtrace can reach by the speed once the sources are added
+    Scalar speed = 0, sourceSpeed = 0;
+    for (std::size_t s = 0; s < subdomains.size(); ++s) {
+        speed = std::max(speed, maxAbs(s, subdomains[s]->velocity));
+        sourceSpeed = std::max(sourceSpeed, maxAbs(s, *addedVelocity[s]));
+    }
+    substeps = slabSubsteps(layouts.front(), dt * (speed + dt * sourceSpeed));
+
+    // The threads are shared evenly among the subdomains. Every subdomain needs one, since
+    // they wait for each other to exchange halos.
+    const int threadsPerSubdomain = std::max<int>(1, omp_get_max_threads() / subdomains.size());
+    NestedParallelism nesting;
+#pragma omp parallel num_threads(subdomains.size()) proc_bind(spread)
+    {
+        const std::size_t s = omp_get_thread_num();
+        omp_set_num_threads(threadsPerSubdomain);
+        for (int substep = 0; substep < substeps; ++substep) {
+            subdomains[s]->step(*addedDensity[s], *addedVelocity[s], dt / substeps);
+        }
+    }
+}
+
+Scalar PartitionedFluidSystem::maxSpeed() const {
+    Scalar speed = 0;
+    for (std::size_t s = 0; s < subdomains.size(); ++s) {
+        speed = std::max(speed, maxAbs(s, subdomains[s]->velocity));
+    }
+    return speed;
+}
+
+Scalar PartitionedFluidSystem::totalDensity() const {
+    double sum = 0;
+    for (std::size_t s = 0; s < subdomains.size(); ++s) {
+        for (std::size_t d = 0; d < DyeField::coords; ++d) {
+            sum += sumOwnedInterior(layouts[s], subdomains[s]->density[d]);
+        }
+    }
+    return sum;
+}
+
+void PartitionedFluidSystem::gatherDensity(DyeField &density) const {
+    // Besides its owned rows, the first and last subdomains hold the outer ghost rows
+    for (std::size_t s = 0; s < subdomains.size(); ++s) {
+        const SlabLayout &layout = layouts[s];
+        const Grid::Index begin = layout.first ? 0 : layout.ownedBegin;
+        const Grid::Index end = layout.last ? layout.ownedEnd + 1 : layout.ownedEnd;
+        for (std::size_t d = 0; d < DyeField::coords; ++d) {
+            copyRows(subdomains[s]->density[d], begin, density[d], begin + layout.rowOffset,
+                     end - begin);
+        }
+    }
+}
+
+void PartitionedFluidSystem::SpinBarrier::wait() {
+    const int currentGeneration = generation.load(std::memory_order_acquire);
+    if (count.fetch_add(1, std::memory_order_acq_rel) == size - 1) {
+        count.store(0, std::memory_order_relaxed);
+        generation.fetch_add(1, std::memory_order_release);
+        return;
+    }
+    while (generation.load(std::memory_order_acquire) == currentGeneration) {
+        std::this_thread::yield();
+    }
+}
+
+void PartitionedFluidSystem::exchangeHalos(std::size_t subdomain, Grid &grid) {
+    // The masters of the subdomain teams copy the halos, once their teams have finished
+    // the grid
+#pragma omp barrier
+#pragma omp master
+    {
+        const SlabLayout &layout = layouts[subdomain];
+        exchanging[subdomain] = &grid;
+        barrier.wait();
+        if (!layout.first) {
+            const SlabLayout &lower = layouts[subdomain - 1];
+            copyRows(*exchanging[subdomain - 1], lower.ownedEnd - lowerHaloRows(layout),
+                     grid, 0, lowerHaloRows(layout));
+        }
+        if (!layout.last) {
+            const SlabLayout &upper = layouts[subdomain + 1];
+            copyRows(*exchanging[subdomain + 1], upper.ownedBegin,
+                     grid, layout.ownedEnd, upperHaloRows(layout, grid));
+        }
+        // Neighbours may only write to their grids once this subdomain has read them
+        barrier.wait();
+    }
+#pragma omp barrier
+}
+
+Scalar PartitionedFluidSystem::maxAbs(std::size_t subdomain, const VelocityField &field) const {
+    Scalar result = 0;
+    for (std::size_t d = 0; d < VelocityField::coords; ++d) {
+        result = std::max(result, maxAbsOwned(layouts[subdomain], field[d]));
+    }
+    return result;
+}
@@ -0,0 +1,69 @@
+#ifndef PARTITIONEDFLUIDSYSTEM_H
+#define PARTITIONEDFLUIDSYSTEM_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "fluidsystem.h"
+#include "slab.h"
+
+// Splits a fluid system within one process into slabs of rows along the y axis, each
+// stepped by its own team of threads with its grids in its own memory. Intended for one
+// subdomain per NUMA node, e.g. with OMP_PLACES=sockets OMP_PROC_BIND=spread,close: the
+// team of each subdomain then runs on one node and only touches that node's memory,
+// except to copy halo rows from its neighbours between kernels.
+//
+// As in DistributedFluidSystem, each subdomain steps the slab of a SlabLayout and
+// refills the rows it does not own whenever its boundaries are set.
+class PartitionedFluidSystem
+{
+public:
+    PartitionedFluidSystem(Grid::Index width, Grid::Index height, Grid::Index depth,
+                           Scalar diffusionConstant = 0, Scalar viscosity = 0,
+                           int numSubdomains = 2, Grid::Index haloWidth = 3);
+    // The subdomains call back into this object
+    PartitionedFluidSystem(const PartitionedFluidSystem &) = delete;
+    PartitionedFluidSystem &operator=(const PartitionedFluidSystem &) = delete;
+
+    const Grid::Index haloWidth;
+    std::vector<SlabLayout> layouts;
+    std::vector<std::shared_ptr<FluidSystem> > subdomains;
+
+    // Number of substeps taken by the last call to step()
+    int substeps = 1;
+
+    // Sources are given per subdomain, in the frame of the subdomain. Allows nested
+    // parallel regions for its length, so must be called outside of parallel regions.
+    void step(const std::vector<const DyeField *> &addedDensity,
+              const std::vector<const VelocityField *> &addedVelocity, Scalar dt);
+
+    Scalar maxSpeed() const;
+    Scalar totalDensity() const;
+    // Copies the density of the whole system into a field of the full size
+    void gatherDensity(DyeField &density) const;
+
+private:
+    // Synchronizes the masters of the subdomain teams, which OpenMP barriers cannot
+    // since each team is a separate nested parallel region
+    class SpinBarrier {
+    public:
+        explicit SpinBarrier(int size) : size(size), count(0), generation(0) {}
+        void wait();
+    private:
+        const int size;
+        std::atomic<int> count;
+        std::atomic<int> generation;
+    };
+
+    SpinBarrier barrier;
+    // The grid each subdomain is exchanging, which corresponds across subdomains since
+    // they all run the same sequence of kernels
+    std::vector<Grid *> exchanging;
+
+    // Exchanges rows with both neighbours (a kernel of the subdomain's team)
+    void exchangeHalos(std::size_t subdomain, Grid &grid);
+    Scalar maxAbs(std::size_t subdomain, const VelocityField &field) const;
+};
+
+#endif // PARTITIONEDFLUIDSYSTEM_H
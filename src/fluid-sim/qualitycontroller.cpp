@@ -0,0 +1,81 @@
+#include "qualitycontroller.h"
+
+#include <algorithm>
+
+namespace {
+
+// Backtraces per field and substep
+int backtraces(FluidSystem::Advection advection) {
+    return advection == FluidSystem::kAdvectionMacCormack ? 3 : 1;
+}
+
+}
+
+const std::vector<QualityController::Level> QualityController::levels = {
+    {4, FluidSystem::kAdvectionSemiLagrangian, 1},
+    {8, FluidSystem::kAdvectionSemiLagrangian, 1},
+    {12, FluidSystem::kAdvectionSemiLagrangian, 2},
+    {20, FluidSystem::kAdvectionSemiLagrangian, 2},
+    {20, FluidSystem::kAdvectionSemiLagrangian, 4},
+    {20, FluidSystem::kAdvectionSemiLagrangian, 8},
+    {20, FluidSystem::kAdvectionMacCormack, 8},
+    {40, FluidSystem::kAdvectionMacCormack, 8}
+};
+
+const std::size_t QualityController::defaultLevel = 5;
+
+QualityController::QualityController() : level(defaultLevel) {}
+
+void QualityController::apply(FluidSystem &system,
+                              TimestepController &timestepController) const {
+    const Level &current = levels[level];
+    system.solverIterations = current.solverIterations;
+    system.advection = current.advection;
+    timestepController.maxSubsteps = current.maxSubsteps;
+    system.phaseTimes.fill(0);
+}
+
+void QualityController::update(double frameTime, const TimestepController &timestepController,
+                               const FluidSystem &system) {
+    ++frames;
+    if (frameTime > budget) ++misses;
+    lastFrameTime = frameTime;
+
+    // Split the cost of a substep by what each level changes
+    const Level &current = levels[level];
+    const int substeps = std::max(1, timestepController.lastSubsteps);
+    const double solverTime = (system.phaseTimes[FluidSystem::kPhaseDiffusion] +
+                               system.phaseTimes[FluidSystem::kPhaseProjection]) / substeps;
+    const double advectionTime = system.phaseTimes[FluidSystem::kPhaseAdvection] / substeps;
+    const double iteration = solverTime / current.solverIterations;
+    const double backtrace = advectionTime / backtraces(current.advection);
+    const double fixed = std::max(0.0, frameTime / substeps - solverTime - advectionTime);
+    if (iterationCost < 0) {
+        iterationCost = iteration;
+        backtraceCost = backtrace;
+        fixedCost = fixed;
+    } else {
+        iterationCost += smoothing * (iteration - iterationCost);
+        backtraceCost += smoothing * (backtrace - backtraceCost);
+        fixedCost += smoothing * (fixed - fixedCost);
+    }
+    neededSubsteps = substeps;
+    substepsCapped = timestepController.mode == TimestepController::kTimestepSubstep &&
+                     substeps >= current.maxSubsteps;
+
+    std::size_t next = level;
+    while (next > 0 && predict(levels[next]) > budget) --next;
+    if (next == level && level + 1 < levels.size() &&
+        predict(levels[level + 1]) <= headroom * budget) {
+        ++next;
+    }
+    level = next;
+}
+
+double QualityController::predict(const Level &level) const {
+    // A frame cut short by the cap would take as many substeps as a higher cap allows
+    const int substeps = substepsCapped ? level.maxSubsteps
+                                        : std::min(level.maxSubsteps, neededSubsteps);
+    return substeps * (fixedCost + iterationCost * level.solverIterations +
+                       backtraceCost * backtraces(level.advection));
+}
@@ -0,0 +1,65 @@
+#ifndef QUALITYCONTROLLER_H
+#define QUALITYCONTROLLER_H
+
+#include <vector>
+
+#include "fluidsystem.h"
+#include "timestepcontroller.h"
+
+// Trades the accuracy of a fluid system's steps for wall time, so that the steps of each
+// frame fit within a budget. From the phase times the system records, it estimates the
+// cost of a Jacobi iteration, of a backtrace and of everything else per substep, and then
+// picks the most accurate level whose predicted frame fits. It drops as many levels as
+// needed at once, but only rises one level at a time and with some headroom to spare, so
+// that it does not oscillate around the budget.
+class QualityController
+{
+public:
+    struct Level {
+        unsigned int solverIterations;
+        FluidSystem::Advection advection;
+        // Cap on the substeps of the timestep controller
+        int maxSubsteps;
+    };
+    // From the cheapest to the most accurate
+    static const std::vector<Level> levels;
+    // The level matching the defaults of FluidSystem and TimestepController
+    static const std::size_t defaultLevel;
+
+    QualityController();
+
+    // Wall time in ms which the steps of a frame should fit within
+    double budget = 16;
+    // Fraction of the budget which the next level's predicted time must fit within
+    double headroom = 0.75;
+    // Weight of the latest frame in the estimated costs
+    double smoothing = 0.25;
+
+    std::size_t level;
+    // Frames recorded so far, and how many of them overran the budget
+    int frames = 0;
+    int misses = 0;
+    double lastFrameTime = 0;
+
+    // Sets up the system and the timestep controller for the current level, and clears
+    // the system's phase times for the next frame
+    void apply(FluidSystem &system, TimestepController &timestepController) const;
+    // Records a frame stepped at the current level, given its wall time, the substeps
+    // taken and the phase times the system accumulated over it, and picks the level for
+    // the next frame
+    void update(double frameTime, const TimestepController &timestepController,
+                const FluidSystem &system);
+
+private:
+    // Estimated costs per substep in ms, or negative before the first frame
+    double iterationCost = -1;
+    double backtraceCost = 0;
+    double fixedCost = 0;
+    // Substeps the last frame needed, if the current level's cap did not cut them short
+    int neededSubsteps = 1;
+    bool substepsCapped = false;
+
+    double predict(const Level &level) const;
+};
+
+#endif // QUALITYCONTROLLER_H
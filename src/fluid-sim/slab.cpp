@@ -0,0 +1,70 @@
+#include "slab.h"
+
+#include <algorithm>
+#include <cmath>
+
+SlabLayout slabLayout(Grid::Index height, int numSlabs, int slab, Grid::Index haloWidth) {
+    SlabLayout layout;
+    const Grid::Index blockSize = height / numSlabs;
+    const Grid::Index remainder = height % numSlabs;
+    layout.numRows = blockSize + (slab < remainder ? 1 : 0);
+    layout.globalBegin = 1 + slab * blockSize + std::min<Grid::Index>(slab, remainder);
+    layout.first = slab == 0;
+    layout.last = slab == numSlabs - 1;
+    const Grid::Index lowOverlap = layout.first ? 0 : haloWidth;
+    const Grid::Index highOverlap = layout.last ? 0 : haloWidth;
+    layout.height = lowOverlap + layout.numRows + highOverlap;
+    layout.ownedBegin = 1 + lowOverlap;
+    layout.ownedEnd = layout.ownedBegin + layout.numRows;
+    layout.rowOffset = layout.globalBegin - layout.ownedBegin;
+    layout.haloWidth = haloWidth;
+    return layout;
+}
+
+Grid::Index lowerHaloRows(const SlabLayout &layout) {
+    return layout.haloWidth + 1;
+}
+Grid::Index upperHaloRows(const SlabLayout &layout, const Grid &grid) {
+    return layout.haloWidth + 1 + grid.dimension(1) - (layout.height + 2);
+}
+
+int slabSubsteps(const SlabLayout &layout, Scalar cellsPerStep) {
+    return std::max(1, static_cast<int>(std::ceil(cellsPerStep / (layout.haloWidth - 1))));
+}
+
+void copyRows(const Grid &source, Grid::Index sourceRow, Grid &target, Grid::Index targetRow,
+              Grid::Index numRows) {
+    const Grid::Index rowLength = source.dimension(0);
+    for (Grid::Index k = 0; k < source.dimension(2); ++k) {
+        const Scalar *rows = source.data() + rowLength * (sourceRow + source.dimension(1) * k);
+        std::copy(rows, rows + rowLength * numRows,
+                  target.data() + rowLength * (targetRow + target.dimension(1) * k));
+    }
+}
+
+Scalar maxAbsOwned(const SlabLayout &layout, const Grid &grid) {
+    const Grid::Index end = layout.last ? layout.ownedEnd + 1 : layout.ownedEnd;
+    Scalar result = 0;
+#pragma omp parallel for collapse(2) schedule(static) reduction(max:result)
+    for (Grid::Index k = 0; k < grid.dimension(2); ++k) {
+        for (Grid::Index j = layout.ownedBegin; j < end; ++j) {
+            for (Grid::Index i = 0; i < grid.dimension(0); ++i) {
+                result = std::max(result, std::abs(grid(i, j, k)));
+            }
+        }
+    }
+    return result;
+}
+
+double sumOwnedInterior(const SlabLayout &layout, const Grid &grid) {
+    double result = 0;
+#pragma omp parallel for collapse(2) schedule(static) reduction(+:result)
+    for (Grid::Index k = 1; k < grid.dimension(2) - 1; ++k) {
+        for (Grid::Index j = layout.ownedBegin; j < layout.ownedEnd; ++j) {
+            for (Grid::Index i = 1; i < grid.dimension(0) - 1; ++i) {
+                result += grid(i, j, k);
+            }
+        }
+    }
+    return result;
+}
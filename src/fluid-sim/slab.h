@@ -0,0 +1,47 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "math.h"
+
+// Layout of one of several slabs of a fluid system split along its y axis. Each slab is
+// stepped as a FluidSystem over the rows it owns, padded on each side shared with a
+// neighbouring slab by haloWidth rows of overlap; those rows and the ghost row beyond
+// them are refilled from the neighbour's owned rows after every update.
+struct SlabLayout {
+    // Rows of the whole system owned by the slab, starting from 1
+    Grid::Index globalBegin, numRows;
+    // Interior height of the slab's FluidSystem, including the overlap
+    Grid::Index height;
+    // Local rows owned by the slab; the last slab also owns the row at ownedEnd of
+    // staggered grids
+    Grid::Index ownedBegin, ownedEnd;
+    // Local row j is row j + rowOffset of the whole system
+    Grid::Index rowOffset;
+    Grid::Index haloWidth;
+    bool first, last;
+};
+
+// Splits the rows as evenly as possible among the slabs, in order
+SlabLayout slabLayout(Grid::Index height, int numSlabs, int slab, Grid::Index haloWidth);
+
+// Rows exchanged between neighbouring slabs: the top lowerHaloRows owned rows of a slab
+// fill the rows below ownedBegin of the next one, whose bottom upperHaloRows owned rows
+// fill the rows from ownedEnd of the previous one. Staggered grids have one more row.
+Grid::Index lowerHaloRows(const SlabLayout &layout);
+Grid::Index upperHaloRows(const SlabLayout &layout, const Grid &grid);
+
+// Copies numRows whole rows, across all depth slices, between grids of the same width
+// and depth
+void copyRows(const Grid &source, Grid::Index sourceRow, Grid &target, Grid::Index targetRow,
+              Grid::Index numRows);
+
+// Substeps which keep backtraces from owned rows within the overlap, given how many cells
+// the fastest velocity moves per step. One row of the overlap is kept as margin for
+// projection and interpolation.
+int slabSubsteps(const SlabLayout &layout, Scalar cellsPerStep);
+
+// Reductions over the rows owned by a slab, for staggered and cell-centered grids
+Scalar maxAbsOwned(const SlabLayout &layout, const Grid &staggeredGrid);
+double sumOwnedInterior(const SlabLayout &layout, const Grid &grid);
+
+#endif // SLAB_H
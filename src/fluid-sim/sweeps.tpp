@@ -0,0 +1,128 @@
+#include "math.h"
+
+#include <utility>
+#include <vector>
+
+// Stencil sweeps over the interior of a grid, as worksharing loops which set the boundaries
+// of the rows they write. Nonzero template parameters are dimensions of the interior known
+// at compile time; the grid has one ghost layer around it. The threads split the y rows
+// alone and sweep all planes of each; with a known Depth, in a loop the compiler unrolls,
+// through row pointers with constant neighbour offsets. The x loops vectorize, and the z
+// neighbours of a row are rows which the sweep of the plane below has just loaded. A known
+// Width and Height also make the loop bounds and strides constants.
+
+template<Grid::Index Width, Grid::Index Height, Grid::Index Depth>
+struct JacobiSweep {
+    template<typename Policy>
+    static void run(Grid &out, const Grid &in, const Grid &x_0, const Location &a, Scalar c,
+                    const Boundaries &boundaries, const Indices &dim) {
+        const Scalar ax = a(0), ay = a(1), az = a(2);
+        const Grid::Index width = Width ? Width : dim(0);
+        const Grid::Index height = Height ? Height : dim(1);
+        const Grid::Index row = Width ? Width + 2 : in.dimension(0);
+        const Grid::Index plane = row * (Height ? Height + 2 : in.dimension(1));
+        sweepRows<Policy>(out, height, boundaries, [&](Grid::Index j) {
+            for (Grid::Index k = 1; k <= Depth; ++k) {
+                const Scalar *centre = in.data() + k * plane + j * row;
+                const Scalar *initial = x_0.data() + k * plane + j * row;
+                Scalar *result = out.data() + k * plane + j * row;
+                for (Grid::Index i = 1; i <= width; ++i) {
+                    result[i] = (initial[i] + ax * (centre[i - 1] + centre[i + 1]) +
+                                 ay * (centre[i - row] + centre[i + row]) +
+                                 az * (centre[i - plane] + centre[i + plane])) / c;
+                }
+            }
+        });
+    }
+};
+template<>
+struct JacobiSweep<0, 0, 0> {
+    template<typename Policy>
+    static void run(Grid &out, const Grid &in, const Grid &x_0, const Location &a, Scalar c,
+                    const Boundaries &boundaries, const Indices &dim) {
+        const Scalar ax = a(0), ay = a(1), az = a(2);
+        sweepRows<Policy>(out, dim(1), boundaries, [&](Grid::Index j) {
+            for (Grid::Index k = 1; k <= dim(2); ++k) {
+                for (Grid::Index i = 1; i <= dim(0); ++i) {
+                    out(i, j, k) = (x_0(i, j, k) + ax * (in(i - 1, j, k) + in(i + 1, j, k)) +
+                                    ay * (in(i, j - 1, k) + in(i, j + 1, k)) +
+                                    az * (in(i, j, k - 1) + in(i, j, k + 1))) / c;
+                }
+            }
+        });
+    }
+};
+
+template<Grid::Index Width, Grid::Index Height, Grid::Index Depth>
+struct ExplicitSweep {
+    template<typename Policy>
+    static void run(Grid &out, const Grid &in, const Location &b,
+                    const Boundaries &boundaries, const Indices &dim) {
+        const Scalar bx = b(0), by = b(1), bz = b(2);
+        const Grid::Index width = Width ? Width : dim(0);
+        const Grid::Index height = Height ? Height : dim(1);
+        const Grid::Index row = Width ? Width + 2 : in.dimension(0);
+        const Grid::Index plane = row * (Height ? Height + 2 : in.dimension(1));
+        sweepRows<Policy>(out, height, boundaries, [&](Grid::Index j) {
+            for (Grid::Index k = 1; k <= Depth; ++k) {
+                const Scalar *centre = in.data() + k * plane + j * row;
+                Scalar *result = out.data() + k * plane + j * row;
+                for (Grid::Index i = 1; i <= width; ++i) {
+                    result[i] = centre[i] +
+                                bx * (centre[i - 1] + centre[i + 1] - 2 * centre[i]) +
+                                by * (centre[i - row] + centre[i + row] - 2 * centre[i]) +
+                                bz * (centre[i - plane] + centre[i + plane] - 2 * centre[i]);
+                }
+            }
+        });
+    }
+};
+template<>
+struct ExplicitSweep<0, 0, 0> {
+    template<typename Policy>
+    static void run(Grid &out, const Grid &in, const Location &b,
+                    const Boundaries &boundaries, const Indices &dim) {
+        const Scalar bx = b(0), by = b(1), bz = b(2);
+        sweepRows<Policy>(out, dim(1), boundaries, [&](Grid::Index j) {
+            for (Grid::Index k = 1; k <= dim(2); ++k) {
+                for (Grid::Index i = 1; i <= dim(0); ++i) {
+                    out(i, j, k) = in(i, j, k) +
+                                   bx * (in(i - 1, j, k) + in(i + 1, j, k) - 2 * in(i, j, k)) +
+                                   by * (in(i, j - 1, k) + in(i, j + 1, k) - 2 * in(i, j, k)) +
+                                   bz * (in(i, j, k - 1) + in(i, j, k + 1) - 2 * in(i, j, k));
+                }
+            }
+        });
+    }
+};
+
+// The sweeps compiled for the shapes registered by specializeKernels(), as pairs of the
+// dimensions of a grid's interior and the run() of the sweep for those
+template<template<Grid::Index, Grid::Index, Grid::Index> class Sweep, typename Policy>
+struct SpecializedSweeps {
+    typedef decltype(&Sweep<0, 0, 0>::template run<Policy>) Run;
+    static std::vector<std::pair<TensorIndices, Run>> kernels;
+};
+template<template<Grid::Index, Grid::Index, Grid::Index> class Sweep, typename Policy>
+std::vector<std::pair<TensorIndices, typename SpecializedSweeps<Sweep, Policy>::Run>>
+    SpecializedSweeps<Sweep, Policy>::kernels;
+
+template<template<Grid::Index, Grid::Index, Grid::Index> class Sweep, typename Policy,
+         Grid::Index Width, Grid::Index Height, Grid::Index Depth>
+void specializeSweep() {
+    SpecializedSweeps<Sweep, Policy>::kernels.emplace_back(
+        TensorIndices{{Width, Height, Depth}}, &Sweep<Width, Height, Depth>::template run<Policy>);
+}
+
+template<Grid::Index Width, Grid::Index Height, Grid::Index Depth>
+void specializeKernels() {
+    static_assert(Width > 0 && Height > 0 && Depth > 0, "Every dimension must be known");
+    specializeSweep<JacobiSweep, Continuity, Width, Height, Depth>();
+    specializeSweep<JacobiSweep, Neumann<0>, Width, Height, Depth>();
+    specializeSweep<JacobiSweep, Neumann<1>, Width, Height, Depth>();
+    specializeSweep<JacobiSweep, Neumann<2>, Width, Height, Depth>();
+    specializeSweep<ExplicitSweep, Continuity, Width, Height, Depth>();
+    specializeSweep<ExplicitSweep, Neumann<0>, Width, Height, Depth>();
+    specializeSweep<ExplicitSweep, Neumann<1>, Width, Height, Depth>();
+    specializeSweep<ExplicitSweep, Neumann<2>, Width, Height, Depth>();
+}
@@ -0,0 +1,54 @@
+#include "taskgraph.h"
+
+#include <algorithm>
+
+#include <omp.h>
+
+TaskGraph::Task TaskGraph::add(std::function<void()> work,
+                               const std::vector<Task> &dependencies, bool team) {
+    Task task = nodes.size();
+    nodes.push_back({work, {}, dependencies.size(), team});
+    for (Task dependency : dependencies) {
+        nodes[dependency].successors.push_back(task);
+    }
+    return task;
+}
+
+void TaskGraph::run() {
+    if (omp_get_level() == 0) {
+#pragma omp parallel
+        run();
+        return;
+    }
+
+#pragma omp single
+    {
+        teamSize = omp_get_num_threads();
+        remainingDependencies = std::vector<std::atomic<std::size_t> >(nodes.size());
+        for (Task task = 0; task < nodes.size(); ++task) {
+            remainingDependencies[task] = nodes[task].numDependencies;
+        }
+        for (Task task = 0; task < nodes.size(); ++task) {
+            if (nodes[task].numDependencies == 0) spawn(task);
+        }
+    } // all tasks are finished at the implicit barrier of single
+}
+
+void TaskGraph::spawn(Task task) {
+#pragma omp task firstprivate(task)
+    {
+#pragma omp parallel num_threads(nodes[task].team ? teamSize : 1)
+        nodes[task].work();
+        for (Task successor : nodes[task].successors) {
+            if (--remainingDependencies[successor] == 0) spawn(successor);
+        }
+    }
+}
+
+NestedParallelism::NestedParallelism() : previousLevels(omp_get_max_active_levels()) {
+    if (!omp_in_parallel()) omp_set_max_active_levels(std::max(2, previousLevels));
+}
+
+NestedParallelism::~NestedParallelism() {
+    if (!omp_in_parallel()) omp_set_max_active_levels(previousLevels);
+}
@@ -0,0 +1,60 @@
+#ifndef TASKGRAPH_H
+#define TASKGRAPH_H
+
+#include <atomic>
+#include <functional>
+#include <vector>
+
+// Runs a dependency graph of work items as OpenMP tasks, so that independent work runs
+// concurrently and idle threads steal ready tasks from the rest of the team.
+//
+// Each task runs in a nested parallel region, so tasks may call the kernels of math.h.
+// Most tasks get a single-thread region and do their share of the work on the task's
+// thread alone; tasks on the critical path can ask for a team as large as the one running
+// the graph, which splits their sweeps across the team while other tasks still run
+// alongside. Such teams are only active within the scope of a NestedParallelism.
+class TaskGraph
+{
+public:
+    typedef std::size_t Task;
+
+    // Adds a task which may only start once all of its dependencies have finished, on a
+    // team of its own if team
+    Task add(std::function<void()> work, const std::vector<Task> &dependencies = {},
+             bool team = false);
+
+    // Runs all tasks and waits for them to finish. Called by every thread of a parallel
+    // region, the team shares the tasks; called outside of one, it opens its own.
+    void run();
+
+private:
+    struct Node {
+        std::function<void()> work;
+        std::vector<Task> successors;
+        std::size_t numDependencies;
+        bool team;
+    };
+    std::vector<Node> nodes;
+    // Threads of the team running the graph
+    int teamSize = 1;
+    std::vector<std::atomic<std::size_t> > remainingDependencies;
+
+    void spawn(Task task);
+};
+
+// Allows parallel regions nested two levels deep while in scope, restoring the previous
+// limit afterwards. The limit can only be changed outside of parallel regions, so within
+// one this does nothing, and the enclosing code decides how deep regions may nest.
+class NestedParallelism
+{
+public:
+    NestedParallelism();
+    ~NestedParallelism();
+    NestedParallelism(const NestedParallelism &) = delete;
+    NestedParallelism &operator=(const NestedParallelism &) = delete;
+
+private:
+    int previousLevels;
+};
+
+#endif // TASKGRAPH_H
@@ -0,0 +1,49 @@
+#include "timestepcontroller.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+Scalar TimestepController::stableDt(Scalar maxSpeed, Scalar sourceSpeed) const {
+    if (sourceSpeed > 0) {
+        // Largest dt with dt * (maxSpeed + dt * sourceSpeed) <= cflNumber
+        const Scalar b = maxSpeed / sourceSpeed;
+        const Scalar c = cflNumber / sourceSpeed;
+        return (std::sqrt(b * b + 4 * c) - b) / 2;
+    }
+    if (maxSpeed > 0) return cflNumber / maxSpeed;
+    return std::numeric_limits<Scalar>::infinity();
+}
+
+Scalar TimestepController::step(FluidSystem &system, const DyeField &addedDensity,
+                                const VelocityField &addedVelocity, Scalar dt) {
+    // Speeds in dye cells, along the axis with the thinnest cells to be safe
+    const Scalar cellsPerLength = 1 / system.spacing.minCoeff();
+    lastMaxSpeed = cellsPerLength * maxSpeed(system.velocity, system.staggeredDim);
+    const Scalar sourceSpeed = cellsPerLength * maxSpeed(addedVelocity, system.staggeredDim);
+    if (mode == kTimestepAdaptive) {
+        lastDt = std::max(minDt, std::min(maxDt, stableDt(lastMaxSpeed, sourceSpeed)));
+        lastSubsteps = 1;
+        system.step(addedDensity, addedVelocity, lastDt);
+        return lastDt;
+    }
+
+    // The velocity changes with every substep, so each one is sized anew
+    Scalar remaining = dt;
+    Scalar speed = lastMaxSpeed;
+    lastDt = dt;
+    lastSubsteps = 0;
+    while (true) {
+        Scalar substep = remaining;
+        if (lastSubsteps < maxSubsteps - 1) {
+            substep /= std::max<Scalar>(1, std::ceil(remaining / stableDt(speed, sourceSpeed)));
+        }
+        system.step(addedDensity, addedVelocity, substep);
+        lastDt = std::min(lastDt, substep);
+        ++lastSubsteps;
+        remaining -= substep;
+        if (remaining <= dt * std::numeric_limits<Scalar>::epsilon()) break;
+        speed = cellsPerLength * maxSpeed(system.velocity, system.staggeredDim);
+    }
+    return dt;
+}
@@ -0,0 +1,42 @@
+#ifndef TIMESTEPCONTROLLER_H
+#define TIMESTEPCONTROLLER_H
+
+#include "fluidsystem.h"
+
+// Chooses timesteps for a fluid system from the CFL condition, i.e. so that no velocity
+// carries the fluid across more than cflNumber cells in one step.
+class TimestepController
+{
+public:
+    enum Mode {
+        // Advance by the requested dt, in as many substeps as stability requires
+        kTimestepSubstep,
+        // Advance by the largest stable dt within [minDt, maxDt], in one step
+        kTimestepAdaptive
+    };
+    Mode mode = kTimestepSubstep;
+
+    // Semi-Lagrangian advection stays stable beyond a CFL number of 1, but strong sources
+    // blow up when they carry the flow much further in a single step
+    Scalar cflNumber = 3;
+    Scalar minDt = 0.005;
+    Scalar maxDt = 0.2;
+    // Upper bound on the substeps of a single call to step, after which the remaining
+    // time is taken in one step regardless of stability
+    int maxSubsteps = 8;
+
+    // What the last call to step did
+    Scalar lastMaxSpeed = 0;
+    Scalar lastDt = 0;
+    int lastSubsteps = 0;
+
+    // Largest dt which satisfies the CFL condition at the given speed, once the sources
+    // have sped the flow up for dt
+    Scalar stableDt(Scalar maxSpeed, Scalar sourceSpeed = 0) const;
+
+    // Steps the system according to the mode, and returns the simulated time
+    Scalar step(FluidSystem &system, const DyeField &addedDensity,
+                const VelocityField &addedVelocity, Scalar dt);
+};
+
+#endif // TIMESTEPCONTROLLER_H
@@ -1,44 +1,58 @@
 #ifndef VECTORFIELD_H
 #define VECTORFIELD_H
 
+#include <vector>
+
 #include "math.h"
+#include "allocation.h"
+#include "vectorfieldexpression.h"
 
 template<Grid::Index numStaggers, std::size_t numCoords>
-class VectorField {
+class VectorField : public VectorFieldExpression<VectorField<numStaggers, numCoords> > {
 public:
     VectorField(const TensorIndices &dimensions);
+    template<typename Expression>
+    VectorField(const VectorFieldExpression<Expression> &expression);
+    VectorField(const VectorField<numStaggers, numCoords> &other) = default;
+    VectorField(VectorField<numStaggers, numCoords> &&other) = default;
 
+    static const Grid::Index staggers = numStaggers;
     static const std::size_t coords = numCoords;
 
     void clear();
 
+    Grid::Dimensions dimensions() const;
     const Grid &operator[](std::size_t coord) const;
     Grid &operator[](std::size_t coord);
 
+    // Assignments are kernels in the sense of math.h: inside a parallel region, every
+    // thread must call them and fields must already have matching dimensions
+    VectorField<numStaggers, numCoords> &operator=(const VectorField<numStaggers, numCoords> &rhs);
+    // Moving (and so std::swap) exchanges storage without copying any grids
+    VectorField<numStaggers, numCoords> &
+    operator=(VectorField<numStaggers, numCoords> &&rhs) = default;
+    template<typename Expression>
+    VectorField<numStaggers, numCoords>
+    &operator=(const VectorFieldExpression<Expression> &rhs);
+    template<typename Expression>
     VectorField<numStaggers, numCoords>
-    &operator+=(const VectorField<numStaggers, numCoords> &rhs);
+    &operator+=(const VectorFieldExpression<Expression> &rhs);
+    template<typename Expression>
     VectorField<numStaggers, numCoords>
-    &operator-=(const VectorField<numStaggers, numCoords> &rhs);
+    &operator-=(const VectorFieldExpression<Expression> &rhs);
     VectorField<numStaggers, numCoords> &operator*=(Scalar rhs);
 
+    // Evaluates an assignment on an Eigen device, e.g. field.device(pool) += other * dt
+    template<typename Device>
+    VectorFieldDevice<VectorField<numStaggers, numCoords>, Device> device(const Device &device);
+
 private:
-    std::array<Grid, numCoords> grids;
+    std::vector<Grid> grids;
+
+    template<typename Expression, typename Assignment>
+    void assign(const Expression &rhs, Assignment assignment);
 
 };
-template<Grid::Index numStaggers, std::size_t numCoords>
-VectorField<numStaggers, numCoords>
-operator-=(VectorField<numStaggers, numCoords> lhs,
-           const VectorField<numStaggers, numCoords> &rhs);
-template<Grid::Index numStaggers, std::size_t numCoords>
-VectorField<numStaggers, numCoords>
-operator-(VectorField<numStaggers, numCoords> lhs,
-          const VectorField<numStaggers, numCoords> &rhs);
-template<Grid::Index numStaggers, std::size_t numCoords>
-VectorField<numStaggers, numCoords>
-operator*(VectorField<numStaggers, numCoords> lhs, Scalar rhs);
-template<Grid::Index numStaggers, std::size_t numCoords>
-VectorField<numStaggers, numCoords>
-operator*(Scalar lhs, VectorField<numStaggers, numCoords> rhs);
 
 #include "vectorfield.tpp"
 
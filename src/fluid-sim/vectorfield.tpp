@@ -1,19 +1,35 @@
 #include "vectorfield.h"
 
 template<Grid::Index numStaggers, std::size_t numCoords>
-VectorField<numStaggers, numCoords>::VectorField(const TensorIndices &dimensions) {
+VectorField<numStaggers, numCoords>::VectorField(const TensorIndices &dimensions) :
+    grids(numCoords) {
     for (auto &grid : grids) {
-      grid = Grid(dimensions);
+        allocateGrid(grid, dimensions);
+    }
+}
+template<Grid::Index numStaggers, std::size_t numCoords>
+template<typename Expression>
+VectorField<numStaggers, numCoords>::VectorField(
+    const VectorFieldExpression<Expression> &expression) : grids(numCoords) {
+    static_assert(Expression::staggers == numStaggers && Expression::coords == numCoords,
+                  "Vector field expression must have the same staggering and coordinates");
+    for (std::size_t i = 0; i < numCoords; ++i) {
+        const Grid::Dimensions &dimensions = expression.derived().dimensions();
+        allocateGrid(grids[i], {dimensions[0], dimensions[1], dimensions[2]});
+        parallelAssign(grids[i], expression.derived()[i], AssignOp());
     }
-    clear();
 }
 template<Grid::Index numStaggers, std::size_t numCoords>
 void VectorField<numStaggers, numCoords>::clear() {
     for (auto &grid : grids) {
-        grid.setZero();
+        zeroGrid(grid);
     }
 }
 template<Grid::Index numStaggers, std::size_t numCoords>
+Grid::Dimensions VectorField<numStaggers, numCoords>::dimensions() const {
+    return grids[0].dimensions();
+}
+template<Grid::Index numStaggers, std::size_t numCoords>
 const Grid &VectorField<numStaggers, numCoords>::operator[](std::size_t coord) const {
     return grids[coord];
 }
@@ -23,52 +39,71 @@ Grid &VectorField<numStaggers, numCoords>::operator[](std::size_t coord) {
 }
 template<Grid::Index numStaggers, std::size_t numCoords>
 VectorField<numStaggers, numCoords>
-&VectorField<numStaggers, numCoords>::operator+=(const VectorField<numStaggers, numCoords> &rhs) {
-    for (std::size_t i = 0; i < numCoords; ++i) {
-        grids[i] += rhs.grids[i];
+&VectorField<numStaggers, numCoords>::operator=(const VectorField<numStaggers, numCoords> &rhs) {
+    if (omp_get_level() == 0) {
+        for (std::size_t i = 0; i < numCoords; ++i) {
+            const Grid::Dimensions &dimensions = rhs.grids[i].dimensions();
+            if (grids[i].size() != rhs.grids[i].size()) {
+                allocateGrid(grids[i], {dimensions[0], dimensions[1], dimensions[2]});
+            } else {
+                grids[i].resize(dimensions);
+            }
+        }
     }
+    assign(rhs, AssignOp());
     return *this;
 }
 template<Grid::Index numStaggers, std::size_t numCoords>
+template<typename Expression>
 VectorField<numStaggers, numCoords>
-&VectorField<numStaggers, numCoords>::operator-=(const VectorField<numStaggers, numCoords> &rhs) {
-    for (std::size_t i = 0; i < numCoords; ++i) {
-        grids[i] -= rhs.grids[i];
-    }
+&VectorField<numStaggers, numCoords>::operator=(const VectorFieldExpression<Expression> &rhs) {
+    static_assert(Expression::staggers == numStaggers && Expression::coords == numCoords,
+                  "Vector field expression must have the same staggering and coordinates");
+    assign(rhs.derived(), AssignOp());
     return *this;
 }
 template<Grid::Index numStaggers, std::size_t numCoords>
+template<typename Expression>
 VectorField<numStaggers, numCoords>
-&VectorField<numStaggers, numCoords>::operator*=(Scalar rhs) {
-    for (std::size_t i = 0; i < numCoords; ++i) {
-        grids[i] = grids[i] * rhs;
-    }
+&VectorField<numStaggers, numCoords>::operator+=(const VectorFieldExpression<Expression> &rhs) {
+    static_assert(Expression::staggers == numStaggers && Expression::coords == numCoords,
+                  "Vector field expression must have the same staggering and coordinates");
+    assign(rhs.derived(), AddAssignOp());
     return *this;
 }
-
 template<Grid::Index numStaggers, std::size_t numCoords>
+template<typename Expression>
 VectorField<numStaggers, numCoords>
-operator+(VectorField<numStaggers, numCoords> lhs,
-          const VectorField<numStaggers, numCoords> &rhs) {
-    lhs += rhs;
-    return lhs;
+&VectorField<numStaggers, numCoords>::operator-=(const VectorFieldExpression<Expression> &rhs) {
+    static_assert(Expression::staggers == numStaggers && Expression::coords == numCoords,
+                  "Vector field expression must have the same staggering and coordinates");
+    assign(rhs.derived(), SubtractAssignOp());
+    return *this;
 }
 template<Grid::Index numStaggers, std::size_t numCoords>
 VectorField<numStaggers, numCoords>
-operator-(VectorField<numStaggers, numCoords> lhs,
-          const VectorField<numStaggers, numCoords> &rhs) {
-    lhs -= rhs;
-    return lhs;
+&VectorField<numStaggers, numCoords>::operator*=(Scalar rhs) {
+    assign(*this * rhs, AssignOp());
+    return *this;
 }
 template<Grid::Index numStaggers, std::size_t numCoords>
-VectorField<numStaggers, numCoords>
-operator*(VectorField<numStaggers, numCoords> lhs, Scalar rhs) {
-    lhs *= rhs;
-    return lhs;
+template<typename Device>
+VectorFieldDevice<VectorField<numStaggers, numCoords>, Device>
+VectorField<numStaggers, numCoords>::device(const Device &device) {
+    return VectorFieldDevice<VectorField<numStaggers, numCoords>, Device>(*this, device);
 }
+
 template<Grid::Index numStaggers, std::size_t numCoords>
-VectorField<numStaggers, numCoords>
-operator*(Scalar lhs, VectorField<numStaggers, numCoords> rhs) {
-    rhs *= lhs;
-    return rhs;
+template<typename Expression, typename Assignment>
+void VectorField<numStaggers, numCoords>::assign(const Expression &rhs, Assignment assignment) {
+    if (omp_get_level() == 0) {
+#pragma omp parallel
+        assign(rhs, assignment);
+        return;
+    }
+    // Coordinates are independent, so one barrier after all of them suffices
+    for (std::size_t i = 0; i < numCoords; ++i) {
+        assignThreadRows(grids[i], rhs[i], assignment);
+    }
+#pragma omp barrier
 }
@@ -0,0 +1,139 @@
+#ifndef VECTORFIELDEXPRESSION_H
+#define VECTORFIELDEXPRESSION_H
+
+#include "math.h"
+
+// Lazily-evaluated arithmetic on vector fields. Each coordinate of an expression is an
+// Eigen tensor expression, so a compound expression like in + 0.5 * (in - out) is only
+// evaluated when it is assigned to a VectorField, in one fused pass per coordinate and
+// without materializing any intermediate fields.
+
+template<Grid::Index numStaggers, std::size_t numCoords>
+class VectorField;
+
+template<typename Derived>
+class VectorFieldExpression {
+public:
+    const Derived &derived() const { return static_cast<const Derived &>(*this); }
+};
+
+// Expressions hold VectorFields by reference and sub-expressions by value, mirroring
+// how Eigen nests tensors and tensor expressions
+template<typename Expression>
+struct VectorFieldNested {
+    typedef const Expression type;
+};
+template<Grid::Index numStaggers, std::size_t numCoords>
+struct VectorFieldNested<VectorField<numStaggers, numCoords> > {
+    typedef const VectorField<numStaggers, numCoords> &type;
+};
+
+struct VectorFieldSumOp {
+    template<typename Lhs, typename Rhs>
+    static auto apply(const Lhs &lhs, const Rhs &rhs) -> decltype(lhs + rhs) {
+        return lhs + rhs;
+    }
+};
+struct VectorFieldDifferenceOp {
+    template<typename Lhs, typename Rhs>
+    static auto apply(const Lhs &lhs, const Rhs &rhs) -> decltype(lhs - rhs) {
+        return lhs - rhs;
+    }
+};
+
+template<typename Lhs, typename Rhs, typename Op>
+class VectorFieldBinaryOp : public VectorFieldExpression<VectorFieldBinaryOp<Lhs, Rhs, Op> > {
+private:
+    typename VectorFieldNested<Lhs>::type lhs;
+    typename VectorFieldNested<Rhs>::type rhs;
+
+public:
+    static_assert(Lhs::staggers == Rhs::staggers && Lhs::coords == Rhs::coords,
+                  "Vector field operands must have the same staggering and coordinates");
+    static const Grid::Index staggers = Lhs::staggers;
+    static const std::size_t coords = Lhs::coords;
+
+    VectorFieldBinaryOp(const Lhs &lhs, const Rhs &rhs) : lhs(lhs), rhs(rhs) {}
+
+    Grid::Dimensions dimensions() const { return lhs.dimensions(); }
+    auto operator[](std::size_t coord) const -> decltype(Op::apply(lhs[coord], rhs[coord])) {
+        return Op::apply(lhs[coord], rhs[coord]);
+    }
+};
+
+template<typename Operand>
+class VectorFieldScalarProduct :
+        public VectorFieldExpression<VectorFieldScalarProduct<Operand> > {
+private:
+    typename VectorFieldNested<Operand>::type operand;
+    Scalar scalar;
+
+public:
+    static const Grid::Index staggers = Operand::staggers;
+    static const std::size_t coords = Operand::coords;
+
+    VectorFieldScalarProduct(const Operand &operand, Scalar scalar) :
+        operand(operand), scalar(scalar) {}
+
+    Grid::Dimensions dimensions() const { return operand.dimensions(); }
+    auto operator[](std::size_t coord) const -> decltype(operand[coord] * scalar) {
+        return operand[coord] * scalar;
+    }
+};
+
+// Evaluates assignments to a VectorField on an Eigen device (such as an
+// Eigen::ThreadPoolDevice), analogous to Eigen's tensor.device(d) = expression
+template<typename Field, typename Device>
+class VectorFieldDevice {
+public:
+    VectorFieldDevice(Field &field, const Device &device) : field(field), device(device) {}
+
+    template<typename Expression>
+    VectorFieldDevice &operator=(const VectorFieldExpression<Expression> &rhs) {
+        for (std::size_t d = 0; d < Field::coords; ++d) {
+            field[d].device(device) = rhs.derived()[d];
+        }
+        return *this;
+    }
+    template<typename Expression>
+    VectorFieldDevice &operator+=(const VectorFieldExpression<Expression> &rhs) {
+        for (std::size_t d = 0; d < Field::coords; ++d) {
+            field[d].device(device) += rhs.derived()[d];
+        }
+        return *this;
+    }
+    template<typename Expression>
+    VectorFieldDevice &operator-=(const VectorFieldExpression<Expression> &rhs) {
+        for (std::size_t d = 0; d < Field::coords; ++d) {
+            field[d].device(device) -= rhs.derived()[d];
+        }
+        return *this;
+    }
+
+private:
+    Field &field;
+    const Device &device;
+};
+
+template<typename Lhs, typename Rhs>
+VectorFieldBinaryOp<Lhs, Rhs, VectorFieldSumOp>
+operator+(const VectorFieldExpression<Lhs> &lhs, const VectorFieldExpression<Rhs> &rhs) {
+    return VectorFieldBinaryOp<Lhs, Rhs, VectorFieldSumOp>(lhs.derived(), rhs.derived());
+}
+template<typename Lhs, typename Rhs>
+VectorFieldBinaryOp<Lhs, Rhs, VectorFieldDifferenceOp>
+operator-(const VectorFieldExpression<Lhs> &lhs, const VectorFieldExpression<Rhs> &rhs) {
+    return VectorFieldBinaryOp<Lhs, Rhs, VectorFieldDifferenceOp>(lhs.derived(), rhs.derived());
+}
+template<typename Operand>
+VectorFieldScalarProduct<Operand>
+operator*(const VectorFieldExpression<Operand> &lhs, Scalar rhs) {
+    return VectorFieldScalarProduct<Operand>(lhs.derived(), rhs);
+}
+template<typename Operand>
+VectorFieldScalarProduct<Operand>
+operator*(Scalar lhs, const VectorFieldExpression<Operand> &rhs) {
+    return VectorFieldScalarProduct<Operand>(rhs.derived(), lhs);
+}
+
+#endif // VECTORFIELDEXPRESSION_H
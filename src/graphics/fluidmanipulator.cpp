@@ -1,10 +1,15 @@
 #include "fluidmanipulator.h"
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 
 FluidManipulator::FluidManipulator(std::shared_ptr<FluidSystem> fluidSystem) :
     fluidSystem(fluidSystem), constantDyeSource(fluidSystem->fullDim),
-    constantFlowSource(fluidSystem->fullStaggeredDim) {
+    constantFlowSource(fluidSystem->fullStaggeredDim), dyeSourceSpans(fluidSystem->fullDim),
+    flowSourceSpans(fluidSystem->fullStaggeredDim) {
+    fluidSystem->setSourceSpans(constantDyeSource, &dyeSourceSpans);
+    fluidSystem->setSourceSpans(constantFlowSource, &flowSourceSpans);
     /*
     Grid::Index centerX = fluidSystem->dim(0) / 2;
     Grid::Index centerY = fluidSystem->dim(1) / 2;
@@ -21,6 +26,10 @@ FluidManipulator::FluidManipulator(std::shared_ptr<FluidSystem> fluidSystem) :
     addDyeCircle(centerX, centerY, halfLength * 4, 2, 1, 1, 0, 0.5);
     */
 }
+FluidManipulator::~FluidManipulator() {
+    fluidSystem->setSourceSpans(constantDyeSource, nullptr);
+    fluidSystem->setSourceSpans(constantFlowSource, nullptr);
+}
 void FluidManipulator::step(Scalar dt) {
     fluidSystem->step(constantDyeSource, constantFlowSource, dt);
 }
@@ -35,11 +44,17 @@ void FluidManipulator::addDyeRect(int x, int y, int halfLength, int halfHeight,
     } else {
         target = &(fluidSystem->density);
     }
-    for (Grid::Index i = x - halfLength; i <= x + halfLength; ++i) {
-        if (i < 0 || i > fluidSystem->dim(0)) continue;
-        for (Grid::Index j = y - halfHeight; j <= y + halfHeight; ++j) {
-            if (j < 0 || j > fluidSystem->dim(1)) continue;
-            for (Grid::Index k = depthStart; k <= depthStop; ++k) {
+    const Grid::Index iStart = std::max<Grid::Index>(x - halfLength, 0);
+    const Grid::Index iEnd = std::min<Grid::Index>(x + halfLength, fluidSystem->dim(0));
+    const Grid::Index jStart = std::max<Grid::Index>(y - halfHeight, 0);
+    const Grid::Index jEnd = std::min<Grid::Index>(y + halfHeight, fluidSystem->dim(1));
+    if (mode == kAdditionConstantAdditive) {
+        dyeSourceSpans.include({iStart, jStart, depthStart}, {iEnd, jEnd, depthStop});
+    }
+#pragma omp parallel for collapse(2) schedule(static)
+    for (Grid::Index k = depthStart; k <= depthStop; ++k) {
+        for (Grid::Index j = jStart; j <= jEnd; ++j) {
+            for (Grid::Index i = iStart; i <= iEnd; ++i) {
                 (*target)[0](i, j, k) = cyan * concentration;
                 (*target)[1](i, j, k) = magenta * concentration;
                 (*target)[2](i, j, k) = yellow * concentration;
@@ -56,24 +71,30 @@ void FluidManipulator::addDyeCircle(int x, int y, int r, Grid::Index depthStop,
     } else {
         target = &(fluidSystem->density);
     }
-    for (int i = x - r; i <= x + r; ++i) {
-        if (i < 0 || i > fluidSystem->dim(0)) continue;
-        for (int j = y - r; j <= y + r; ++j) {
-            if (j < 0 || j > fluidSystem->dim(1)) continue;
-            int dx = i - x;
-            int dy = j - y;
-            int outerDistance = dx * dx + dy * dy - r * r;
-            if (outerDistance > 0) continue;
-            // Is this how real people do antialiasing? Who knows! I hacked this
-            // together by trial and error (and by applying the coverage of implicit
-            // functions from the first lecture). This heuristic works well, so.
-            Scalar antialias = 1;
-            if (outerDistance >= -2.0 * r) {
-                antialias = -outerDistance / (2.0 * r);
-                if (concentration >= 1) antialias /= concentration;
-                else antialias *= concentration;
-            }
-            for (Grid::Index k = 1; k <= depthStop; ++k) {
+    const int iStart = std::max(x - r, 0);
+    const int iEnd = std::min<int>(x + r, fluidSystem->dim(0));
+    const int jStart = std::max(y - r, 0);
+    const int jEnd = std::min<int>(y + r, fluidSystem->dim(1));
+    if (mode == kAdditionConstantAdditive) {
+        dyeSourceSpans.include({iStart, jStart, 1}, {iEnd, jEnd, depthStop});
+    }
+#pragma omp parallel for collapse(2) schedule(static)
+    for (Grid::Index k = 1; k <= depthStop; ++k) {
+        for (int j = jStart; j <= jEnd; ++j) {
+            for (int i = iStart; i <= iEnd; ++i) {
+                int dx = i - x;
+                int dy = j - y;
+                int outerDistance = dx * dx + dy * dy - r * r;
+                if (outerDistance > 0) continue;
+                // Is this how real people do antialiasing? Who knows! I hacked this
+                // together by trial and error (and by applying the coverage of implicit
+                // functions from the first lecture). This heuristic works well, so.
+                Scalar antialias = 1;
+                if (outerDistance >= -2.0 * r) {
+                    antialias = -outerDistance / (2.0 * r);
+                    if (concentration >= 1) antialias /= concentration;
+                    else antialias *= concentration;
+                }
                 if (mode == kAdditionReplacement) {
                     (*target)[0](i, j, k) = 0;
                     (*target)[1](i, j, k) = 0;
@@ -90,32 +111,44 @@ void FluidManipulator::addDyeCircle(int x, int y, int r, Grid::Index depthStop,
 void FluidManipulator::addSoapRect(int x, int y, int halfLength, int halfHeight,
                                    Scalar outwardsVelocity, Scalar upwardsVelocity,
                                    AdditionMode mode) {
+    // A held velocity would miss the new flow
+    fluidSystem->requestVelocityUpdate();
     VelocityField *target;
     if (mode == kAdditionConstantAdditive) {
         target = &constantFlowSource;
     } else {
         target = &(fluidSystem->velocity);
     }
+    // Map from dye cells to those of the velocity grid
+    const int scale = fluidSystem->velocityScale;
+    x = velocityCell(x);
+    y = velocityCell(y);
+    halfLength /= scale;
+    halfHeight /= scale;
+    if (mode == kAdditionConstantAdditive) {
+        flowSourceSpans.include({x - halfLength, y - halfHeight, 1},
+                                {x + halfLength, y + halfHeight, 1});
+    }
     // Add top and bottom velocities
     for (Grid::Index i = x - halfLength; i <= x + halfLength; ++i) {
-        if (i < 0 || i > fluidSystem->dim(0)) continue;
+        if (i < 0 || i > fluidSystem->velocityDim(0)) continue;
         if (y - halfHeight >= 0) { // bottom in bounds
             (*target)[1](i, y - halfHeight, 1) = -outwardsVelocity;
             (*target)[2](i, y - halfHeight, 1) = -upwardsVelocity;
         }
-        if (y + halfHeight <= fluidSystem->dim(1)) { // top in bounds
+        if (y + halfHeight <= fluidSystem->velocityDim(1)) { // top in bounds
             (*target)[1](i, y + halfHeight, 1) = outwardsVelocity;
             (*target)[2](i, y + halfHeight, 1) = -upwardsVelocity;
         }
     }
     // Add left and right velocities
     for (Grid::Index j = y - halfHeight; j <= y + halfHeight; ++j) {
-        if (j < 0 || j > fluidSystem->dim(1)) continue;
+        if (j < 0 || j > fluidSystem->velocityDim(1)) continue;
         if (x - halfLength >= 0) { // left in bounds
             (*target)[0](x - halfLength, j, 1) = -outwardsVelocity;
             (*target)[2](x - halfLength, j, 1) = -upwardsVelocity;
         }
-        if (x + halfLength <= fluidSystem->dim(0)) { // right in bounds
+        if (x + halfLength <= fluidSystem->velocityDim(0)) { // right in bounds
             (*target)[0](x + halfLength, j, 1) = outwardsVelocity;
             (*target)[2](x + halfLength, j, 1) = -upwardsVelocity;
         }
@@ -123,18 +156,31 @@ void FluidManipulator::addSoapRect(int x, int y, int halfLength, int halfHeight,
 }
 void FluidManipulator::addSoapCircle(int x, int y, int r, Scalar outwardsFlux,
                                      Scalar upwardsFlux, AdditionMode mode) {
+    // A held velocity would miss the new flow
+    fluidSystem->requestVelocityUpdate();
     VelocityField *target;
     if (mode == kAdditionConstantAdditive) {
         target = &constantFlowSource;
     } else {
         target = &(fluidSystem->velocity);
     }
+    const int scale = fluidSystem->velocityScale;
     Scalar outwardsVelocity = outwardsFlux * 2 * 3.14159 * r;
     Scalar upwardsVelocity = upwardsFlux * 2 * 3.14159 * r;
-    for (int i = x - r; i <= x + r; ++i) {
-        if (i < 0 || i > fluidSystem->dim(0)) continue;
-        for (int j = y - r; j <= y + r; ++j) {
-            if (j < 0 || j > fluidSystem->dim(1)) continue;
+    // Map from dye cells to those of the velocity grid
+    x = velocityCell(x);
+    y = velocityCell(y);
+    r = std::max(1, r / scale);
+    const int iStart = std::max(x - r, 0);
+    const int iEnd = std::min<int>(x + r, fluidSystem->velocityDim(0));
+    const int jStart = std::max(y - r, 0);
+    const int jEnd = std::min<int>(y + r, fluidSystem->velocityDim(1));
+    if (mode == kAdditionConstantAdditive) {
+        flowSourceSpans.include({iStart, jStart, 1}, {iEnd, jEnd, 1});
+    }
+#pragma omp parallel for schedule(static)
+    for (int j = jStart; j <= jEnd; ++j) {
+        for (int i = iStart; i <= iEnd; ++i) {
             int dx = i - x;
             int dy = j - y;
             int outerDistance = dx * dx + dy * dy - r * r;
@@ -144,8 +190,10 @@ void FluidManipulator::addSoapCircle(int x, int y, int r, Scalar outwardsFlux,
             // functions from the first lecture). This heuristic works well, so.
             if (outerDistance < -4.0 * r) continue;
             Scalar antialias = -outerDistance / (4.0 * r);
-            Scalar x_component = dx / std::sqrt(dx * dx + dy * dy);
-            Scalar y_component = dy / std::sqrt(dx * dx + dy * dy);
+            // Small circles reach their centre, which has no outward direction
+            const Scalar distance = std::sqrt(dx * dx + dy * dy);
+            Scalar x_component = distance > 0 ? dx / distance : 0;
+            Scalar y_component = distance > 0 ? dy / distance : 0;
             if (mode == kAdditionReplacement) {
               (*target)[0](i, j, 1) = 0;
               (*target)[1](i, j, 1) = 0;
@@ -158,10 +206,53 @@ void FluidManipulator::addSoapCircle(int x, int y, int r, Scalar outwardsFlux,
     }
 }
 
+void FluidManipulator::resample() {
+    const Grid::Dimensions &dyeSize = constantDyeSource[0].dimensions();
+    const Indices dyeDim = {dyeSize[0] - 2, dyeSize[1] - 2, dyeSize[2] - 2};
+    const Grid::Dimensions &flowSize = constantFlowSource[0].dimensions();
+    const Indices flowDim = {flowSize[0] - 3, flowSize[1] - 3, flowSize[2] - 3};
+    DyeField dyeSource(fluidSystem->fullDim);
+    VelocityField flowSource(fluidSystem->fullStaggeredDim);
+    for (std::size_t d = 0; d < DyeField::coords; ++d) {
+        resampleConcentration(dyeSource[d], fluidSystem->dim, constantDyeSource[d], dyeDim);
+    }
+    for (std::size_t d = 0; d < VelocityField::coords; ++d) {
+        resampleVelocity(flowSource[d], fluidSystem->velocityDim, constantFlowSource[d],
+                         flowDim, d);
+    }
+    constantDyeSource = std::move(dyeSource);
+    constantFlowSource = std::move(flowSource);
+    // Resampling spreads the stamps over neighbouring cells
+    dyeSourceSpans.reset(fluidSystem->fullDim);
+    flowSourceSpans.reset(fluidSystem->fullStaggeredDim);
+    for (std::size_t d = 0; d < DyeField::coords; ++d) {
+        dyeSourceSpans.include(constantDyeSource[d]);
+    }
+    for (std::size_t d = 0; d < VelocityField::coords; ++d) {
+        flowSourceSpans.include(constantFlowSource[d]);
+    }
+    fluidSystem->requestVelocityUpdate();
+}
 
 void FluidManipulator::clearConstantDyeSource() {
     constantDyeSource.clear();
+    dyeSourceSpans.clear();
 }
 void FluidManipulator::clearConstantFlowSource() {
     constantFlowSource.clear();
+    flowSourceSpans.clear();
+    fluidSystem->requestVelocityUpdate();
+}
+
+int FluidManipulator::velocityCell(int x) const {
+    // Velocity cell I covers dye cells s * (I - 1) + 1 to s * I
+    if (x <= 0) return x;
+    return (x - 1) / fluidSystem->velocityScale + 1;
+}
+
+const DyeField &FluidManipulator::dyeSource() const {
+    return constantDyeSource;
+}
+const VelocityField &FluidManipulator::flowSource() const {
+    return constantFlowSource;
 }
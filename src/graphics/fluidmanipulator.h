@@ -15,6 +15,9 @@ class FluidManipulator
 {
 public:
     FluidManipulator(std::shared_ptr<FluidSystem> fluidSystem);
+    FluidManipulator(const FluidManipulator &other) = delete;
+    FluidManipulator &operator=(const FluidManipulator &other) = delete;
+    ~FluidManipulator();
 
     void step(Scalar dt);
 
@@ -32,13 +35,28 @@ public:
     void addSoapCircle(int x, int y, int radius, Scalar outwardsFlux, Scalar upwardsFlux,
                        AdditionMode mode = kAdditionAdditive);
 
+    // Carries the constant sources over to the current dimensions of the fluid system,
+    // after FluidSystem::resample(); must be called outside of parallel regions
+    void resample();
+
     void clearConstantDyeSource();
     void clearConstantFlowSource();
 
+    // Constant sources, which step() adds to the fluid system. The fluid system knows
+    // where they were stamped, and only adds them there.
+    const DyeField &dyeSource() const;
+    const VelocityField &flowSource() const;
+
 private:
     std::shared_ptr<FluidSystem> fluidSystem;
     DyeField constantDyeSource;
     VelocityField constantFlowSource;
+    // Where the constant sources have been stamped since they were last cleared
+    SourceSpans dyeSourceSpans;
+    SourceSpans flowSourceSpans;
+
+    // Index along x or y of the velocity cell holding a dye cell
+    int velocityCell(int x) const;
 };
 
 #endif // FLUIDMANIPULATOR_H
@@ -1,18 +1,20 @@
 #include "fluidtexture.h"
 
-FluidTexture::FluidTexture(const std::shared_ptr<FluidSystem> &fluidSystem) :
-    fluidSystem(fluidSystem)
+FluidTexture::FluidTexture(const std::shared_ptr<DensityFrames> &frames) :
+    frames(frames)
 {
     glGenTextures(DyeField::coords, &ids[0]);
 }
 
 void FluidTexture::generate() {
+    const DyeField &density = frames->front();
+    size = density[0].dimensions();
     for (std::size_t i = 0; i < DyeField::coords; ++i) {
-        const auto &d = fluidSystem->density[i].dimensions();
+        const auto &d = density[i].dimensions();
 
         glBindTexture(GL_TEXTURE_3D, ids[i]);
         glTexImage3D(GL_TEXTURE_3D, 0, internalFormat, d[0], d[1], d[2] - 2, 0, format, GL_FLOAT,
-                     fluidSystem->density[i].data() + 1 * d[0] * d[1]);
+                     density[i].data() + 1 * d[0] * d[1]);
         glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
         glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
         glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -23,12 +25,19 @@ void FluidTexture::generate() {
 }
 
 void FluidTexture::update() {
+    if (!frames->consume()) return;
+    const DyeField &density = frames->front();
+    const auto &newSize = density[0].dimensions();
+    if (newSize[0] != size[0] || newSize[1] != size[1] || newSize[2] != size[2]) {
+        generate();
+        return;
+    }
     for (std::size_t i = 0; i < DyeField::coords; ++i) {
-        const auto &d = fluidSystem->density[i].dimensions();
+        const auto &d = density[i].dimensions();
 
         glBindTexture(GL_TEXTURE_3D, ids[i]);
         glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, d[0], d[1], d[2] - 2, format, GL_FLOAT,
-                        fluidSystem->density[i].data() + 1 * d[0] * d[1]);
+                        density[i].data() + 1 * d[0] * d[1]);
         glBindTexture(GL_TEXTURE_3D, 0);
     }
 }
@@ -6,14 +6,14 @@
 
 #include <GL/glew.h>
 
-#include "../fluid-sim/fluidsystem.h"
+#include "simulationworker.h"
 
 // Based on the LearnOpenGL 2D Game Rendering Sprites tutorial, with heavy modifications
 
 class FluidTexture
 {
 public:
-    FluidTexture(const std::shared_ptr<FluidSystem> &fluidSystem);
+    FluidTexture(const std::shared_ptr<DensityFrames> &frames);
 
     static const std::size_t textures = DyeField::coords;
 
@@ -26,15 +26,18 @@ public:
     GLuint filterMin = GL_LINEAR; // if fluid texture pixels < screen pixels
     GLuint filterMax = GL_LINEAR; // if fluid texture pixels > screen pixels
 
-    // Generates fluid texture from fluid data
+    // Generates fluid texture from the current density frame
     void generate();
-    // Updates fluid texture from fluid data
+    // Updates fluid texture from the latest published density frame, if there is a new one;
+    // regenerates it if the frame's dimensions have changed, e.g. after a resample
     void update();
     // Binds the specified color channel as the current active GL_TEXTURE_2D texture object
     void bind(std::size_t channel) const;
 
 private:
-    std::shared_ptr<FluidSystem> fluidSystem;
+    std::shared_ptr<DensityFrames> frames;
+    // Dimensions of the density grids the texture was generated from
+    Grid::Dimensions size;
 };
 
 #endif // FLUIDTEXTURE_H
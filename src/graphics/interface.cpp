@@ -10,10 +10,13 @@
 
 #include "resourcemanager.h"
 
-Interface::Interface(GLint width, GLint height, Grid::Index depth, Scalar dt) :
-    width(width), height(height), depth(depth), viewport(0, 0, width, height),
-    dt(dt), fluidSystem(std::make_shared<FluidSystem>(width, height, depth)),
-    manipulator(fluidSystem) {}
+Interface::Interface(GLint width, GLint height, Grid::Index depth, Scalar dt,
+                     Grid::Index velocityScale) :
+    width(width), height(height), depth(depth), fluidWidth(width), fluidHeight(height),
+    viewport(0, 0, width, height),
+    dt(dt),
+    fluidSystem(std::make_shared<FluidSystem>(width, height, depth, 0, 0, velocityScale)),
+    manipulator(fluidSystem), worker(fluidSystem, manipulator) {}
 
 Interface::~Interface() {}
 
@@ -28,7 +31,7 @@ void Interface::init() {
     // Set render-specific controls
     canvas = new Canvas(ResourceManager::getShader("canvas"), width, height);
     // Load textures
-    ResourceManager::loadFluidTexture("fluid", fluidSystem);
+    ResourceManager::loadFluidTexture("fluid", worker.frames());
     ResourceManager::getShader("canvas").setInteger("width", width);
     ResourceManager::getShader("canvas").setInteger("height", height);
     ResourceManager::getShader("canvas").setInteger("scatterDepth", fluidSystem->dim(2) / 2);
@@ -49,8 +52,15 @@ void Interface::init() {
     std::cout << "Simulation timestep is now " << (dt * 1000) << " ms." << std::endl;
     std::cout << "  Adjust the timestep in +/- 10 ms increments with ` "
               << "and decrease with ^`." << std::endl;
+    std::cout << "  Steps are split into substeps as needed for stability." << std::endl;
+    std::cout << "  Toggle adaptive timesteps, the largest stable ones, with N." << std::endl;
+    std::cout << "  Settled flow is updated every few steps; dye is moved every step." << std::endl;
+    std::cout << "Steps trade accuracy for speed to fit within " << worker.frameBudget
+              << " ms.\n  Toggle this with M." << std::endl;
     std::cout << "Using Neumann boundary conditions for all system edges." << std::endl;
     std::cout << "  Toggle sides with , and top/bottom with . ." << std::endl;
+    std::cout << "The fluid grid follows the size of the window.\n"
+              << "  Toggle half resolution, for speed, with L." << std::endl;
     std::cout << "~~~~DYE~~~~" << std::endl;
     std::cout << "Droplet color is now CMY=(" << dropletCyan << ","
               << dropletMagenta << "," << dropletYellow << ")" << std::endl;
@@ -84,11 +94,22 @@ void Interface::init() {
     std::cout << "Print average per-frame render time and framerate with TAB.\n"
               << "  Average is calculated over a 10 s interval and updated every 10 s." << std::endl;
     std::cout << "\n\nHAVE FUN!" << std::endl;
+
+    // Settled flow only needs updating every few frames
+    fluidSystem->adaptiveVelocityInterval = true;
+    fluidSystem->maxVelocityInterval = 4;
+    // Flow slower than this is invisible, so idle canvases stop updating it
+    fluidSystem->restThreshold = 0.01;
+
+    // From now on, the fluid system and manipulator may only be touched through the worker
+    worker.start();
 }
 
 void Interface::update(GLfloat dt) {
-    if (state != INTERFACE_ACTIVE) return;
-    manipulator.step(this->dt ? this->dt : dt);
+    worker.setActive(state == INTERFACE_ACTIVE);
+    worker.setTimestep(this->dt ? this->dt : dt);
+    worker.setAdaptiveTimestep(adaptiveTimestep);
+    worker.setQualityControl(qualityControl);
     ResourceManager::getFluidTexture("fluid").update();
 }
 
@@ -155,28 +176,79 @@ void Interface::processSimulationInput(GLfloat dt) {
         std::cout << "Simulation timestep is now " << (this->dt * 1000) << " ms." << std::endl;
         keysUp[GLFW_KEY_GRAVE_ACCENT] = GL_FALSE;
     }
-    if (keysUp[GLFW_KEY_COMMA]) { // toggle horizontal boundary conditions
-        fluidSystem->horizontalNeumann = !fluidSystem->horizontalNeumann;
-        if (fluidSystem->horizontalNeumann) {
-          std::cout << "Now using Neumann boundary conditions for the sides." << std::endl;
+    if (keysUp[GLFW_KEY_N]) { // toggle adaptive timesteps
+        adaptiveTimestep = !adaptiveTimestep;
+        if (adaptiveTimestep) {
+            std::cout << "Now using adaptive timesteps." << std::endl;
+        } else {
+            std::cout << "Now using a fixed timestep of " << (this->dt * 1000) << " ms." << std::endl;
+        }
+        keysUp[GLFW_KEY_N] = GL_FALSE;
+    }
+    if (keysUp[GLFW_KEY_M]) { // toggle quality control
+        qualityControl = !qualityControl;
+        if (qualityControl) {
+            std::cout << "Now fitting steps within " << worker.frameBudget << " ms." << std::endl;
         } else {
-            std::cout << "Now using continuity boundary conditions for the sides." << std::endl;
+            std::cout << "Now stepping at full accuracy." << std::endl;
         }
+        keysUp[GLFW_KEY_M] = GL_FALSE;
+    }
+    if (keysUp[GLFW_KEY_L]) { // toggle level of detail
+        detailDivisor = detailDivisor == 1 ? 2 : 1;
+        if (detailDivisor == 1) {
+            std::cout << "Now simulating at full resolution." << std::endl;
+        } else {
+            std::cout << "Now simulating at half resolution." << std::endl;
+        }
+        keysUp[GLFW_KEY_L] = GL_FALSE;
+    }
+    resampleFluid();
+    if (keysUp[GLFW_KEY_COMMA]) { // toggle horizontal boundary conditions
+        worker.post([this] {
+            fluidSystem->horizontalNeumann = !fluidSystem->horizontalNeumann;
+            fluidSystem->requestVelocityUpdate();
+            if (fluidSystem->horizontalNeumann) {
+                std::cout << "Now using Neumann boundary conditions for the sides." << std::endl;
+            } else {
+                std::cout << "Now using continuity boundary conditions for the sides." << std::endl;
+            }
+        });
 
         keysUp[GLFW_KEY_COMMA] = GL_FALSE;
     }
     if (keysUp[GLFW_KEY_PERIOD]) { // toggle vertical boundary conditions
-        fluidSystem->verticalNeumann = !fluidSystem->verticalNeumann;
-        if (fluidSystem->verticalNeumann) {
-            std::cout << "Now using Neumann boundary conditions for the top and bottom." << std::endl;
-        } else {
-            std::cout << "Now using continuity boundary conditions for the top and bottom." << std::endl;
-        }
+        worker.post([this] {
+            fluidSystem->verticalNeumann = !fluidSystem->verticalNeumann;
+            fluidSystem->requestVelocityUpdate();
+            if (fluidSystem->verticalNeumann) {
+                std::cout << "Now using Neumann boundary conditions for the top and bottom." << std::endl;
+            } else {
+                std::cout << "Now using continuity boundary conditions for the top and bottom." << std::endl;
+            }
+        });
 
         keysUp[GLFW_KEY_PERIOD] = GL_FALSE;
     }
 }
 
+static void printDiffusion(const char *field, const FluidSystem::Diffusion &diffusion) {
+    std::cout << "  " << field << ": ";
+    switch (diffusion.scheme) {
+    case FluidSystem::kDiffusionNone:
+        std::cout << "skipped";
+        break;
+    case FluidSystem::kDiffusionExplicit:
+        std::cout << "explicit, " << diffusion.sweeps << " sweep(s)";
+        break;
+    case FluidSystem::kDiffusionImplicit:
+        std::cout << "implicit, " << diffusion.sweeps << " iterations";
+        break;
+    }
+    std::cout << " at diffusion numbers (" << diffusion.numbers(0) << ", "
+              << diffusion.numbers(1) << ", " << diffusion.numbers(2) << ")" << std::endl;
+}
+
 void Interface::processRenderInput(GLfloat dt) {
     const GLfloat saturationVelocity = 1;
     const GLfloat minSaturation = 0.5;
@@ -209,6 +281,25 @@ void Interface::processRenderInput(GLfloat dt) {
         } else {
             std::cout << "Frame render time: " << renderTime << " ms (" << (1000.0 / renderTime) << " fps)" << std::endl;
         }
+        if (worker.stepTime() != -1) {
+            std::cout << "Simulation step time: " << worker.stepTime() << " ms" << std::endl;
+        }
+        std::cout << "Simulation timestep: " << (worker.substepDt() * 1000) << " ms in "
+                  << worker.substeps() << " substep(s)" << std::endl;
+        const QualityController::Level &level = QualityController::levels[worker.qualityLevel()];
+        std::cout << "Simulation quality: level " << worker.qualityLevel() << " of "
+                  << (QualityController::levels.size() - 1) << ", "
+                  << level.solverIterations << " solver iterations, "
+                  << (level.advection == FluidSystem::kAdvectionMacCormack ? "MacCormack"
+                                                                           : "semi-Lagrangian")
+                  << " advection, up to " << level.maxSubsteps << " substep(s)" << std::endl;
+        if (qualityControl) {
+            std::cout << "  " << worker.deadlineMisses() << " of " << worker.controlledSteps()
+                      << " steps overran the " << worker.frameBudget << " ms budget" << std::endl;
+        }
+        std::cout << "Simulation diffusion:" << std::endl;
+        printDiffusion("dye", worker.densityDiffusion());
+        printDiffusion("velocity", worker.velocityDiffusion());
         keysUp[GLFW_KEY_TAB] = GL_FALSE;
     }
 }
@@ -234,20 +325,23 @@ void Interface::processManipulationInput(GLfloat dt) {
     if (keysUp[GLFW_KEY_APOSTROPHE]) {
         if (keys[GLFW_KEY_RIGHT_SHIFT] || keys[GLFW_KEY_LEFT_SHIFT]) {
             std::cout << "Clearing constant dye sources." << std::endl;
-            manipulator.clearConstantDyeSource();
+            worker.post([this] { manipulator.clearConstantDyeSource(); });
         } else {
             std::cout << "Clearing all dye." << std::endl;
-            fluidSystem->density.clear();
+            worker.post([this] { fluidSystem->density.clear(); });
         }
         keysUp[GLFW_KEY_APOSTROPHE] = GL_FALSE;
     }
     if (keysUp[GLFW_KEY_SLASH]) {
         if (keys[GLFW_KEY_RIGHT_SHIFT] || keys[GLFW_KEY_LEFT_SHIFT]) {
             std::cout << "Clearing constant flow sources." << std::endl;
-            manipulator.clearConstantFlowSource();
+            worker.post([this] { manipulator.clearConstantFlowSource(); });
         } else {
             std::cout << "Clearing all flow." << std::endl;
-            fluidSystem->velocity.clear();
+            worker.post([this] {
+                fluidSystem->velocity.clear();
+                fluidSystem->requestVelocityUpdate();
+            });
         }
         keysUp[GLFW_KEY_SLASH] = GL_FALSE;
     }
@@ -366,16 +460,29 @@ void Interface::processManipulationInput(GLfloat dt) {
         } else if (keys[GLFW_KEY_RIGHT_CONTROL] || keys[GLFW_KEY_LEFT_CONTROL]) {
             mode = kAdditionReplacement;
         }
+        // Canvas cells per fluid cell
+        const Scalar scaleX = static_cast<Scalar>(width) / fluidWidth;
+        const Scalar scaleY = static_cast<Scalar>(height) / fluidHeight;
+        const int x = std::round(gridPos[0] / scaleX), y = std::round(gridPos[1] / scaleY);
         if (buttonsUp[GLFW_MOUSE_BUTTON_LEFT]) {
-            manipulator.addDyeCircle(std::round(gridPos[0]), std::round(gridPos[1]),
-                                     dropletRadius, dropletDepth,
-                                     dropletCyan, dropletMagenta, dropletYellow,
-                                     dropletConcentration, mode);
+            const int radius = std::max(1L, std::lround(dropletRadius / scaleX));
+            const Grid::Index depthStop = dropletDepth;
+            const Scalar cyan = dropletCyan, magenta = dropletMagenta, yellow = dropletYellow;
+            const Scalar concentration = dropletConcentration;
+            worker.post([=] {
+                manipulator.addDyeCircle(x, y, radius, depthStop, cyan, magenta, yellow,
+                                         concentration, mode);
+            });
             buttonsUp[GLFW_MOUSE_BUTTON_LEFT] = GL_FALSE;
         } else if (buttonsUp[GLFW_MOUSE_BUTTON_RIGHT]) {
-            manipulator.addSoapCircle(std::round(gridPos[0]), std::round(gridPos[1]),
-                                      soapRadius, soapOutwardsFlux, soapUpwardsFlux,
-                                      kAdditionConstantAdditive);
+            const int radius = std::max(1L, std::lround(soapRadius / scaleX));
+            // Keep the speeds of the soap as at full resolution, where the flux is per cell
+            const Scalar outwardsFlux = soapOutwardsFlux * soapRadius / radius;
+            const Scalar upwardsFlux = soapUpwardsFlux * soapRadius / radius;
+            worker.post([=] {
+                manipulator.addSoapCircle(x, y, radius, outwardsFlux, upwardsFlux,
+                                          kAdditionConstantAdditive);
+            });
             buttonsUp[GLFW_MOUSE_BUTTON_RIGHT] = GL_FALSE;
         }
     }
@@ -393,6 +500,25 @@ void Interface::processResize(GLint newWidth, GLint newHeight, GLint windowZoom)
     ResourceManager::getShader("canvas").setMatrix4("projection", projectionMatrix);
 }
 
+void Interface::resampleFluid() {
+    // The velocity scale must divide the dimensions of the fluid
+    const Grid::Index scale = fluidSystem->velocityScale;
+    const Grid::Index newWidth = std::max(scale, width / detailDivisor / scale * scale);
+    const Grid::Index newHeight = std::max(scale, height / detailDivisor / scale * scale);
+    if (newWidth == fluidWidth && newHeight == fluidHeight) return;
+
+    fluidWidth = newWidth;
+    fluidHeight = newHeight;
+    const Grid::Index fluidDepth = depth;
+    worker.post([=] {
+        fluidSystem->resample(newWidth, newHeight, fluidDepth);
+        manipulator.resample();
+    });
+    ResourceManager::getShader("canvas").setInteger("width", fluidWidth);
+    ResourceManager::getShader("canvas").setInteger("height", fluidHeight);
+    std::cout << "Fluid grid is now " << fluidWidth << "x" << fluidHeight << "." << std::endl;
+}
+
 void Interface::render() {
     canvas->draw(ResourceManager::getFluidTexture("fluid"));
 }
@@ -10,6 +10,7 @@
 #include "canvas.h"
 
 #include "fluidmanipulator.h"
+#include "simulationworker.h"
 
 enum SimulationState {
     INTERFACE_ACTIVE,
@@ -20,7 +21,8 @@ enum SimulationState {
 class Interface
 {
 public:
-    Interface(GLint width, GLint height, Grid::Index depth, Scalar dt);
+    Interface(GLint width, GLint height, Grid::Index depth, Scalar dt,
+              Grid::Index velocityScale = 1);
     ~Interface();
 
     SimulationState state = INTERFACE_PAUSED;
@@ -48,15 +50,22 @@ private:
     glm::mat4 projectionMatrix;
     GLint width, height;
     Grid::Index depth;
+    // Canvas cells per fluid cell along x and y, and the dimensions the fluid system was last
+    // resampled to; the fluid follows the size of the canvas at this level of detail
+    Grid::Index detailDivisor = 1;
+    Grid::Index fluidWidth, fluidHeight;
     glm::vec4 viewport;
 
     Scalar dt;
+    bool adaptiveTimestep = false;
+    bool qualityControl = true;
     std::shared_ptr<FluidSystem> fluidSystem;
 
     GLfloat saturation = 1;
     GLfloat visibility = 0.8;
 
     FluidManipulator manipulator;
+    SimulationWorker worker;
 
     Scalar dropletCyan = 0;
     Scalar dropletMagenta = 0;
@@ -72,6 +81,8 @@ private:
     void processSimulationInput(GLfloat dt);
     void processRenderInput(GLfloat dt);
     void processManipulationInput(GLfloat dt);
+    // Resamples the fluid system if the canvas or the level of detail no longer match it
+    void resampleFluid();
 };
 
 #endif // INTERFACE_H
@@ -18,8 +18,8 @@ Shader &ResourceManager::getShader(std::string name) {
 }
 
 FluidTexture &ResourceManager::loadFluidTexture(std::string name,
-                                                const std::shared_ptr<FluidSystem> &fluidSystem) {
-    fluidTextures.emplace(std::make_pair(name, fluidSystem));
+                                                const std::shared_ptr<DensityFrames> &frames) {
+    fluidTextures.emplace(std::make_pair(name, frames));
     fluidTextures.at(name).generate();
     return fluidTextures.at(name);
 }
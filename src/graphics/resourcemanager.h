@@ -11,7 +11,6 @@
 #include "fluidtexture.h"
 #include "shader.h"
 
-#include "../fluid-sim/fluidsystem.h"
 
 // A static singleton that hosts several functions to load FluidTextures and Shaders.
 // Each loaded resource is also stored for future reference by string handles.
@@ -25,9 +24,9 @@ public:
                               std::string fShaderFile, std::string gShaderFile = std::string());
     // Retrieves a stored shader
     static Shader &getShader(std::string name);
-    // Loads (and generates) a fluidTexture from a fluid system
+    // Loads (and generates) a fluidTexture from published density frames
     static FluidTexture &loadFluidTexture(std::string name,
-                                          const std::shared_ptr<FluidSystem> &fluidSystem);
+                                          const std::shared_ptr<DensityFrames> &frames);
     // Retrieves a stored fluid texture
     static FluidTexture &getFluidTexture(std::string name);
     // Properly deallocates all loaded resources
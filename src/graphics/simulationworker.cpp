@@ -0,0 +1,151 @@
+#include "simulationworker.h"
+
+SimulationWorker::SimulationWorker(const std::shared_ptr<FluidSystem> &fluidSystem,
+                                   FluidManipulator &manipulator) :
+    fluidSystem(fluidSystem), manipulator(manipulator),
+    densityFrames(std::make_shared<DensityFrames>(fluidSystem->density)),
+    running(false), active(false), dt(0), adaptiveTimestep(false), averageStepTime(-1),
+    lastDt(0), lastSubsteps(0), qualityControl(false),
+    lastQualityLevel(QualityController::defaultLevel), numControlledSteps(0),
+    numDeadlineMisses(0),
+    lastDensityDiffusion({FluidSystem::kDiffusionNone, Location::Zero(), 0}),
+    lastVelocityDiffusion({FluidSystem::kDiffusionNone, Location::Zero(), 0}) {
+    qualityController.budget = frameBudget;
+}
+
+SimulationWorker::~SimulationWorker() {
+    stop();
+}
+
+void SimulationWorker::start() {
+    if (running) return;
+    running = true;
+    thread = std::thread(&SimulationWorker::run, this);
+}
+
+void SimulationWorker::stop() {
+    running = false;
+    if (thread.joinable()) thread.join();
+}
+
+void SimulationWorker::setActive(bool active) {
+    this->active = active;
+}
+
+void SimulationWorker::setTimestep(Scalar dt) {
+    this->dt = dt;
+}
+
+void SimulationWorker::setAdaptiveTimestep(bool adaptive) {
+    adaptiveTimestep = adaptive;
+}
+
+void SimulationWorker::setQualityControl(bool enabled) {
+    qualityControl = enabled;
+}
+
+void SimulationWorker::post(std::function<void()> command) {
+    std::lock_guard<std::mutex> lock(commandsMutex);
+    commands.push_back(std::move(command));
+}
+
+const std::shared_ptr<DensityFrames> &SimulationWorker::frames() const {
+    return densityFrames;
+}
+
+double SimulationWorker::stepTime() const {
+    return averageStepTime;
+}
+
+Scalar SimulationWorker::substepDt() const {
+    return lastDt;
+}
+
+int SimulationWorker::substeps() const {
+    return lastSubsteps;
+}
+
+std::size_t SimulationWorker::qualityLevel() const {
+    return lastQualityLevel;
+}
+
+int SimulationWorker::controlledSteps() const {
+    return numControlledSteps;
+}
+
+int SimulationWorker::deadlineMisses() const {
+    return numDeadlineMisses;
+}
+
+FluidSystem::Diffusion SimulationWorker::densityDiffusion() const {
+    std::lock_guard<std::mutex> lock(diffusionMutex);
+    return lastDensityDiffusion;
+}
+
+FluidSystem::Diffusion SimulationWorker::velocityDiffusion() const {
+    std::lock_guard<std::mutex> lock(diffusionMutex);
+    return lastVelocityDiffusion;
+}
+
+void SimulationWorker::run() {
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point lastCheckpoint = Clock::now();
+    std::chrono::duration<double, std::milli> steppingTime(0);
+    int steps = 0;
+
+    while (running) {
+        const Clock::time_point start = Clock::now();
+        bool changed = runCommands();
+        if (active) {
+            const bool controlled = qualityControl;
+            if (!controlled) qualityController.level = QualityController::defaultLevel;
+            qualityController.apply(*fluidSystem, timestepController);
+            lastQualityLevel = qualityController.level;
+
+            const Clock::time_point stepStart = Clock::now();
+            timestepController.mode = adaptiveTimestep ? TimestepController::kTimestepAdaptive
+                                                       : TimestepController::kTimestepSubstep;
+            timestepController.step(*fluidSystem, manipulator.dyeSource(),
+                                    manipulator.flowSource(), dt);
+            const std::chrono::duration<double, std::milli> stepTime = Clock::now() - stepStart;
+            lastDt = timestepController.lastDt;
+            lastSubsteps = timestepController.lastSubsteps;
+            {
+                std::lock_guard<std::mutex> lock(diffusionMutex);
+                lastDensityDiffusion = fluidSystem->densityDiffusion;
+                lastVelocityDiffusion = fluidSystem->velocityDiffusion;
+            }
+            if (controlled) {
+                qualityController.update(stepTime.count(), timestepController, *fluidSystem);
+                numControlledSteps = qualityController.frames;
+                numDeadlineMisses = qualityController.misses;
+            }
+            steppingTime += Clock::now() - start;
+            ++steps;
+            changed = true;
+        }
+        if (changed) {
+            densityFrames->back() = fluidSystem->density;
+            densityFrames->publish();
+        }
+
+        if (start - lastCheckpoint >= std::chrono::seconds(5)) {
+            if (steps) averageStepTime = steppingTime.count() / steps;
+            steppingTime = std::chrono::duration<double, std::milli>(0);
+            steps = 0;
+            lastCheckpoint = start;
+        }
+        std::this_thread::sleep_until(
+                start + std::chrono::duration_cast<Clock::duration>(stepInterval));
+    }
+}
+
+bool SimulationWorker::runCommands() {
+    std::vector<std::function<void()> > pending;
+    {
+        std::lock_guard<std::mutex> lock(commandsMutex);
+        pending.swap(commands);
+    }
+    for (auto &command : pending) command();
+    return !pending.empty();
+}
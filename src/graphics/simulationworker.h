@@ -0,0 +1,99 @@
+#ifndef SIMULATIONWORKER_H
+#define SIMULATIONWORKER_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "triplebuffer.h"
+#include "fluidmanipulator.h"
+#include "../fluid-sim/qualitycontroller.h"
+#include "../fluid-sim/timestepcontroller.h"
+
+typedef TripleBuffer<DyeField> DensityFrames;
+
+// Steps a fluid system on a dedicated thread, so that rendering and simulation run at
+// independent rates. Once started, the worker owns the fluid system and its manipulator:
+// other threads must only change them through post(), and only read the density frames
+// which the worker publishes after every step.
+class SimulationWorker
+{
+public:
+    SimulationWorker(const std::shared_ptr<FluidSystem> &fluidSystem,
+                     FluidManipulator &manipulator);
+    ~SimulationWorker();
+
+    // Shortest wall time between the starts of consecutive steps, to be set before start()
+    std::chrono::duration<double> stepInterval = std::chrono::duration<double>(1.0 / 60);
+
+    void start();
+    void stop();
+
+    // Whether the worker should step the fluid system
+    void setActive(bool active);
+    // Simulation time to advance per step, in as many substeps as stability requires
+    void setTimestep(Scalar dt);
+    // Whether to instead advance by the largest stable timestep
+    void setAdaptiveTimestep(bool adaptive);
+    // Whether to adapt the accuracy of steps so that each fits within the frame budget;
+    // otherwise steps use the default accuracy
+    void setQualityControl(bool enabled);
+    // Queues a change to the fluid system or manipulator, to be run on the worker thread
+    // before its next step
+    void post(std::function<void()> command);
+
+    // Density frames for the renderer to consume
+    const std::shared_ptr<DensityFrames> &frames() const;
+    // Average wall time of a step in ms over the last 5 s, or -1 if not yet known
+    double stepTime() const;
+    // Smallest timestep and number of substeps taken by the last step
+    Scalar substepDt() const;
+    int substeps() const;
+    // Level of accuracy of the last step, among QualityController::levels
+    std::size_t qualityLevel() const;
+    // Steps taken under quality control, and how many of them overran the frame budget
+    int controlledSteps() const;
+    int deadlineMisses() const;
+    // How the last step diffused dye, and the last velocity update diffused velocity
+    FluidSystem::Diffusion densityDiffusion() const;
+    FluidSystem::Diffusion velocityDiffusion() const;
+
+    // Wall time in ms which a step should fit within under quality control
+    const double frameBudget = 16;
+
+private:
+    std::shared_ptr<FluidSystem> fluidSystem;
+    FluidManipulator &manipulator;
+    std::shared_ptr<DensityFrames> densityFrames;
+
+    std::thread thread;
+    std::atomic<bool> running;
+    std::atomic<bool> active;
+    std::atomic<Scalar> dt;
+    std::atomic<bool> adaptiveTimestep;
+    std::atomic<double> averageStepTime;
+    std::atomic<Scalar> lastDt;
+    std::atomic<int> lastSubsteps;
+    std::atomic<bool> qualityControl;
+    std::atomic<std::size_t> lastQualityLevel;
+    std::atomic<int> numControlledSteps;
+    std::atomic<int> numDeadlineMisses;
+    mutable std::mutex diffusionMutex;
+    FluidSystem::Diffusion lastDensityDiffusion, lastVelocityDiffusion;
+
+    TimestepController timestepController;
+    QualityController qualityController;
+
+    std::mutex commandsMutex;
+    std::vector<std::function<void()> > commands;
+
+    void run();
+    // Runs all queued commands; returns false if there were none
+    bool runCommands();
+};
+
+#endif // SIMULATIONWORKER_H
@@ -0,0 +1,44 @@
+#ifndef TRIPLEBUFFER_H
+#define TRIPLEBUFFER_H
+
+#include <array>
+#include <atomic>
+
+// Lock-free single-producer single-consumer hand-off of the latest value of T.
+// The producer fills back() and publishes it; the consumer takes the most recently
+// published value into front(). Neither side ever waits for the other, and the producer
+// may overwrite values that the consumer never got to see.
+template<typename T>
+class TripleBuffer
+{
+public:
+    explicit TripleBuffer(const T &initial) :
+        buffers{{initial, initial, initial}}, middle(1) {}
+
+    // The buffer owned by the producer
+    T &back() { return buffers[backIndex]; }
+    // Makes the contents of back() available to the consumer
+    void publish() {
+        backIndex = middle.exchange(backIndex | kDirty, std::memory_order_acq_rel) & kIndex;
+    }
+
+    // The buffer owned by the consumer
+    const T &front() const { return buffers[frontIndex]; }
+    // Moves the latest published value into front(); returns false if nothing new was published
+    bool consume() {
+        if (!(middle.load(std::memory_order_acquire) & kDirty)) return false;
+        frontIndex = middle.exchange(frontIndex, std::memory_order_acq_rel) & kIndex;
+        return true;
+    }
+
+private:
+    static const unsigned int kIndex = 3;
+    static const unsigned int kDirty = 4;
+
+    std::array<T, 3> buffers;
+    unsigned int backIndex = 0;
+    std::atomic<unsigned int> middle;
+    unsigned int frontIndex = 2;
+};
+
+#endif // TRIPLEBUFFER_H
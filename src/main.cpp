@@ -1,5 +1,6 @@
 #include <algorithm>
 #include <iostream>
+#include <memory>
 
 // GLEW
 #define GLEW_STATIC
@@ -7,6 +8,7 @@
 #include <GLFW/glfw3.h>
 
 #include "src/graphics/interface.h"
+#include "src/fluid-sim/allocation.h"
 
 // GLFW function prototypes
 void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mode);
@@ -16,13 +18,31 @@ void cursorCallback(GLFWwindow* window, double xpos, double ypos);
 void resizeCallback(GLFWwindow *window, GLint width, GLint height);
 
 // Grid and window dimensions
-const GLint WIDTH = 80, HEIGHT = 80;
+const GLint WIDTH = 80, HEIGHT = 80, DEPTH = 6;
 const GLint ZOOM = 6;
+// Coarsening of the velocity grid in x and y relative to the dye grid, which must divide
+// WIDTH and HEIGHT; 2 or 4 cut the cost of the velocity update several times over
+const GLint VELOCITY_SCALE = 1;
 
-Interface ui(WIDTH, HEIGHT, 6, 0.05);
+// Simulation field memory placement, which must be set before ui allocates any fields
+const AllocationPolicy ALLOCATION = {true, kHugePagesNone};
+
+std::unique_ptr<Interface> ui;
 
 // Boilerplate starter code from CS 148 (Summer 2016) Assignment 3's starter code.
 int main() {
+    setAllocationPolicy(ALLOCATION);
+
+    // Solver kernels for the dye grids, and for the pressure and staggered velocity grids
+    specializeKernels<WIDTH, HEIGHT, DEPTH>();
+    if (VELOCITY_SCALE > 1) {
+        specializeKernels<WIDTH / VELOCITY_SCALE, HEIGHT / VELOCITY_SCALE, DEPTH>();
+    }
+    specializeKernels<WIDTH / VELOCITY_SCALE + 1, HEIGHT / VELOCITY_SCALE + 1, DEPTH + 1>();
+    ui.reset(new Interface(WIDTH, HEIGHT, DEPTH, 0.05, VELOCITY_SCALE));
+
+    reportThreadBinding(std::cout);
+
     // Init GLFW
     glfwInit();
     // Set all the required options for GLFW
@@ -62,9 +82,9 @@ int main() {
     GLfloat lastFrame = 0.0f;
 
     // Initialize ui
-    ui.init();
-    ui.processResize(WIDTH, HEIGHT, ZOOM);
-    ui.state = INTERFACE_ACTIVE;
+    ui->init();
+    ui->processResize(WIDTH, HEIGHT, ZOOM);
+    ui->state = INTERFACE_ACTIVE;
 
     double lastCheckpoint = glfwGetTime();
     int renderedFrames = 0;
@@ -77,7 +97,7 @@ int main() {
         lastFrame = currentFrame;
         ++renderedFrames;
         if (currentFrame - lastCheckpoint >= 5) {
-            ui.renderTime = 5 * 1000.0 / renderedFrames;
+            ui->renderTime = 5 * 1000.0 / renderedFrames;
             renderedFrames = 0;
             lastCheckpoint = currentFrame;
         }
@@ -86,13 +106,13 @@ int main() {
         glfwPollEvents();
 
         // Manage user input and game state
-        ui.processInput(deltaTime);
-        ui.update(deltaTime);
+        ui->processInput(deltaTime);
+        ui->update(deltaTime);
 
         // Render
         glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT);
-        ui.render();
+        ui->render();
 
         // Swap the screen buffers
         glfwSwapBuffers(window);
@@ -108,13 +128,13 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mode
     if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS) glfwSetWindowShouldClose(window, GL_TRUE);
     if (key >= 0 && key < 1024) {
         if (action == GLFW_PRESS) {
-            ui.keys[key] = GL_TRUE;
-            ui.keysDown[key] = GL_TRUE;
-            ui.keysUp[key] = GL_FALSE;
+            ui->keys[key] = GL_TRUE;
+            ui->keysDown[key] = GL_TRUE;
+            ui->keysUp[key] = GL_FALSE;
         } else if (action == GLFW_RELEASE) {
-            ui.keys[key] = GL_FALSE;
-            ui.keysUp[key] = GL_TRUE;
-            ui.keysDown[key] = GL_FALSE;
+            ui->keys[key] = GL_FALSE;
+            ui->keysUp[key] = GL_TRUE;
+            ui->keysDown[key] = GL_FALSE;
         }
     }
 }
@@ -123,31 +143,31 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mode
 void clickCallback(GLFWwindow* window, int button, int action, int mode) {
     if (button >= 0 && button < 3) {
         if (action == GLFW_PRESS) {
-            ui.buttons[button] = GL_TRUE;
-            ui.buttonsDown[button] = GL_TRUE;
-            ui.buttonsUp[button] = GL_FALSE;
+            ui->buttons[button] = GL_TRUE;
+            ui->buttonsDown[button] = GL_TRUE;
+            ui->buttonsUp[button] = GL_FALSE;
         } else if (action == GLFW_RELEASE) {
-            ui.buttons[button] = GL_FALSE;
-            ui.buttonsUp[button] = GL_TRUE;
-            ui.buttonsDown[button] = GL_FALSE;
+            ui->buttons[button] = GL_FALSE;
+            ui->buttonsUp[button] = GL_TRUE;
+            ui->buttonsDown[button] = GL_FALSE;
         }
     }
 }
 
 // Is called whenever the mouse is scrolled via GLFW
 void scrollCallback(GLFWwindow* window, double xoffset, double yoffset) {
-    ui.scroll[0] = xoffset;
-    ui.scroll[1] = yoffset;
+    ui->scroll[0] = xoffset;
+    ui->scroll[1] = yoffset;
 }
 
 // Is called whenever the mouse is moved via GLFW
 void cursorCallback(GLFWwindow* window, double xpos, double ypos) {
-    ui.cursor[0] = xpos;
-    ui.cursor[1] = ypos;
+    ui->cursor[0] = xpos;
+    ui->cursor[1] = ypos;
 }
 
 // Is called whenever the window is resized via GLFW
 void resizeCallback(GLFWwindow* window, GLint width, GLint height) {
-    ui.processResize(width / ZOOM, height / ZOOM, ZOOM);
+    ui->processResize(width / ZOOM, height / ZOOM, ZOOM);
     glViewport(0, 0, width, height);
 }